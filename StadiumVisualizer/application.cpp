@@ -16,6 +16,9 @@
 #include <GL/glew.h>
 
 #include "../StadiumGenerator/stadium.h"
+#include "../StadiumGenerator/stadium_wireframe.h"
+#include "../StadiumGenerator/stadium_surface.h"
+#include "../StadiumGenerator/stadium_cull.h"
 
 
 // Static Members
@@ -105,6 +108,17 @@ static GLuint compile_link_vs_fs(const std::string& vert_shader_file, const std:
 }
 
 
+// Culling state of the drawn stadium: the box and the index range of every block, and the
+// commands of the current frame.
+struct StadiumDrawState {
+  std::vector<AABB>               block_boxes;
+  std::vector<size_t>             block_first;
+  std::vector<uint8_t>            visible;
+  std::vector<StadiumDrawCommand> commands;
+};
+
+static_assert(sizeof(StadiumDrawCommand) == sizeof(DrawElementsIndirectCommand), "the culled commands are uploaded as is");
+
 Application::Application() {
   initialization_step = true;
   m_worldmat = m_viewmat = m_projmat = glm::mat4(1.0f);
@@ -155,144 +169,103 @@ void Application::init() {
   e = glGetError();
 }
 
-void Application::create() {
-  compileShaders();
-
+// Writes the vertex and the color of the mesh point p.
+static void store_point(const float3& p, float* point, float* color) {
+  // the colors follow the lattice coordinates before the scaling
+  float x = p.v[0] / stadium_len[0];
+  float y = p.v[1] / stadium_len[1];
+  float z = p.v[2] / stadium_len[2];
+  bool  lit = x + y + z > 0.6f;
+
+  point[0] = p.v[0];
+  point[1] = p.v[1];
+  point[2] = p.v[2];
+  color[0] = lit ? x : 0.2f;
+  color[1] = lit ? y : 0.2f;
+  color[2] = lit ? z : 0.2f;
+}
 
-  Stadium stadium;
-  read_stadium_definition("../StadiumGenerator/stadium.def", stadium);
+// Traversal sink filling the vertex and color buffers, every block into its own range. The line
+// indices are the unique lattice edges, built once from the block list.
+struct StadiumLineSink {
+  static const bool visits_points = true;
+  static const bool parallel      = true;
 
   std::vector<float> points;
   std::vector<float> colors;
-  std::vector<int> indices;
-
-  float len[] = { 0.25f, 0.25f, 0.25f };
-
-  for (int l = 0; l < stadium.num_layers; l++){
-    float layer_dim[3] = {
-      stadium.layer_bbox[l].max.v[0] - stadium.layer_bbox[l].min.v[0],
-      stadium.layer_bbox[l].max.v[1] - stadium.layer_bbox[l].min.v[1],
-      stadium.layer_bbox[l].max.v[2] - stadium.layer_bbox[l].min.v[2]
-    };
-
-    float  elem_dim_z = layer_dim[2];
-    float  offset_z = stadium.layer_bbox[l].min.v[2]; // static_cast<float>(l) / (stadium.num_layers - 1);
-
-    int layer_type = stadium.layers[l];
-
-    for (size_t i = 0; i < stadium.layer_types[layer_type].size(); i++){
-      for (size_t j = 0; j < stadium.layer_types[layer_type][i].size(); j++){
-
-        float elem_dim_x = 1.0f / static_cast<float>(stadium.layer_types[layer_type].size()) * layer_dim[0];
-        float elem_dim_y = 1.0f / static_cast<float>(stadium.layer_types[layer_type][i].size()) * layer_dim[1];
-
-        float offset_x = stadium.layer_bbox[l].min.v[0] + static_cast<float>(i)* elem_dim_x;
-        float offset_y = stadium.layer_bbox[l].min.v[1] + static_cast<float>(j)* elem_dim_y;
-
-        uint32_t block_type = stadium.layer_types[layer_type][i][j];
-        int dims[3] = { stadium.block_sizes[3 * block_type + 0], stadium.block_sizes[3 * block_type + 1], stadium.block_sizes[3 * block_type + 2] };
-
-        uint32_t offset_points = static_cast<uint32_t>(points.size() / 3);
-
-        // Generating the points
-        for (int d0 = 0; d0 <= dims[0]; d0++)
-          for (int d1 = 0; d1 <= dims[1]; d1++)
-            for (int d2 = 0; d2 <= dims[2]; d2++){
-
-              float local_x = static_cast<float>(d0) / static_cast<float>(dims[0]);
-              float local_y = static_cast<float>(d1) / static_cast<float>(dims[1]);
-              float local_z = static_cast<float>(d2) / static_cast<float>(dims[2]);
+  StadiumWireframe   wireframe;
 
-              float x = (offset_x + local_x * elem_dim_x);
-              float y = (offset_y + local_y * elem_dim_y);
-              float z = (offset_z + local_z * elem_dim_z);
-
-              points.push_back(x * len[0]);
-              points.push_back(y * len[1]);
-              points.push_back(z * len[2]);
-
-              if (x + y + z > 0.6f){
-                colors.push_back(x);
-                colors.push_back(y);
-                colors.push_back(z);
-              }
-              else {
-                colors.push_back(0.2f);
-                colors.push_back(0.2f);
-                colors.push_back(0.2f);
-              }
-            }
-
-        // Adding the points to the lists
-        for (int d0 = 0; d0 < dims[0]; d0++)
-          for (int d1 = 0; d1 < dims[1]; d1++)
-            for (int d2 = 0; d2 < dims[2]; d2++){
-
-              int p0 = (offset_points +  d0      * (dims[1] + 1) * (dims[2] + 1) +  d1       * (dims[2] + 1) + d2    );
-              int p1 = (offset_points + (d0 + 1) * (dims[1] + 1) * (dims[2] + 1) +  d1       * (dims[2] + 1) + d2    );
-              int p2 = (offset_points + (d0 + 1) * (dims[1] + 1) * (dims[2] + 1) +  d1       * (dims[2] + 1) + d2 + 1);
-              int p3 = (offset_points +  d0      * (dims[1] + 1) * (dims[2] + 1) +  d1       * (dims[2] + 1) + d2 + 1);
-              int p4 = (offset_points +  d0      * (dims[1] + 1) * (dims[2] + 1) + (d1 + 1)  * (dims[2] + 1) + d2    );
-              int p5 = (offset_points + (d0 + 1) * (dims[1] + 1) * (dims[2] + 1) + (d1 + 1)  * (dims[2] + 1) + d2    );
-              int p6 = (offset_points + (d0 + 1) * (dims[1] + 1) * (dims[2] + 1) + (d1 + 1)  * (dims[2] + 1) + d2 + 1);
-              int p7 = (offset_points +  d0      * (dims[1] + 1) * (dims[2] + 1) + (d1 + 1)  * (dims[2] + 1) + d2 + 1);
-
-              indices.push_back(p0);
-              indices.push_back(p1);
-
-              indices.push_back(p1);
-              indices.push_back(p2);
-
-              indices.push_back(p2);
-              indices.push_back(p3);
+  void begin(const StadiumSizes& sizes, const std::vector<StadiumBlock>& blocks){
+    points.resize(3 * sizes.points);
+    colors.resize(3 * sizes.points);
+    build_stadium_wireframe(blocks, wireframe);
+  }
 
-              indices.push_back(p3);
-              indices.push_back(p0);
+  void point(size_t index, const float3& p){
+    store_point(p, points.data() + 3 * index, colors.data() + 3 * index);
+  }
 
+  void block(const StadiumBlock&){}
+};
 
-              indices.push_back(p4);
-              indices.push_back(p5);
+void Application::create() {
+  compileShaders();
 
-              indices.push_back(p5);
-              indices.push_back(p6);
 
-              indices.push_back(p6);
-              indices.push_back(p7);
+  Stadium stadium;
+  if (!read_stadium_definition("../StadiumGenerator/stadium.def", stadium))
+    exit(EXIT_FAILURE);
 
-              indices.push_back(p7);
-              indices.push_back(p4);
+  // past this many line indices only the block and layer outlines are drawn
+  static const size_t max_line_indices = static_cast<size_t>(1) << 26;
 
+  StadiumSizes sizes;
+  compute_stadium_sizes(stadium, sizes, STADIUM_FLAG_HEX8);
 
-              indices.push_back(p0);
-              indices.push_back(p4);
+  std::vector<float>    points;
+  std::vector<float>    colors;
+  std::vector<uint32_t> indices;
 
-              indices.push_back(p1);
-              indices.push_back(p5);
+  draw_state.reset(new StadiumDrawState());
 
-              indices.push_back(p2);
-              indices.push_back(p6);
+  // every lattice point starts at most three edges
+  if (6 * sizes.points <= max_line_indices){
+    StadiumLineSink sink;
+    traverse_stadium(stadium, sink);
 
-              indices.push_back(p3);
-              indices.push_back(p7);
+    points.swap(sink.points);
+    colors.swap(sink.colors);
+    indices.swap(sink.wireframe.indices);
 
-          }
-      }
-    }
+    // the blocks are culled one by one
+    std::vector<StadiumBlock> blocks;
+    compute_stadium_blocks(stadium, blocks);
+    compute_stadium_block_boxes(blocks, draw_state->block_boxes);
+    draw_state->block_first.swap(sink.wireframe.block_first);
+  }
+  else {
+    StadiumSurface outlines;
+    extract_stadium_outlines(stadium, outlines);
+
+    points.resize(3 * outlines.points.size());
+    colors.resize(3 * outlines.points.size());
+    for (size_t p = 0; p < outlines.points.size(); p++)
+      store_point(outlines.points[p], points.data() + 3 * p, colors.data() + 3 * p);
+    indices.swap(outlines.indices);
+
+    // the outlines are culled as a whole
+    AABB bounds;
+    for (const float3& p : outlines.points)
+      bounds.extend(p);
+    draw_state->block_boxes.assign(1, bounds);
+    draw_state->block_first.push_back(0);
+    draw_state->block_first.push_back(indices.size());
   }
 
-  DrawElementsIndirectCommand indirect_cmds[4] = {
-    {
-      indices.size(),
-      1,
-      0,
-      0,
-      0
-    }
-  };
-
+  // the commands are rebuilt every frame from the visible blocks
   glGenBuffers(1, &indirect_buffer);
   glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
-  glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(indirect_cmds), indirect_cmds, GL_STATIC_DRAW);
+  glBufferData(GL_DRAW_INDIRECT_BUFFER, draw_state->block_boxes.size() * sizeof(StadiumDrawCommand), NULL, GL_STREAM_DRAW);
 
   glGenBuffers(1, &vertex_buffer);
   glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
@@ -304,7 +277,7 @@ void Application::create() {
 
   glGenBuffers(1, &index_buffer);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(int), indices.data(), GL_STATIC_DRAW);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
 }
 
 void Application::update(float time, float timeSinceLastFrame) {
@@ -352,8 +325,16 @@ void Application::draw() {
 #ifndef TRY_INDIRECT
   glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
 #else
+  glm::mat4 view_proj = m_projmat * m_viewmat * m_worldmat;
+
+  StadiumFrustum frustum;
+  compute_stadium_frustum(&view_proj[0][0], frustum);
+  cull_stadium_boxes(frustum, draw_state->block_boxes, draw_state->visible);
+  size_t num_commands = build_stadium_draw_commands(draw_state->visible, draw_state->block_first, draw_state->commands);
+
   glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
-  glMultiDrawElementsIndirect(GL_LINES, GL_UNSIGNED_INT, 0, 1, 0);
+  glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, num_commands * sizeof(StadiumDrawCommand), draw_state->commands.data());
+  glMultiDrawElementsIndirect(GL_LINES, GL_UNSIGNED_INT, 0, static_cast<GLsizei>(num_commands), 0);
 #endif
   e = glGetError();
 
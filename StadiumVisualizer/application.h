@@ -7,6 +7,7 @@
 
 
 // STD
+#include <memory>
 #include <string>
 #include <stdlib.h>
 #include <stdio.h>
@@ -19,6 +20,8 @@ typedef  struct {
   GLuint  baseInstance;
 } DrawElementsIndirectCommand;
 
+struct StadiumDrawState;
+
 class Application {
 public:
   Application();
@@ -67,6 +70,7 @@ private:
   GLuint color_buffer;
   GLuint index_buffer;
   GLuint indirect_buffer;
+  std::unique_ptr<StadiumDrawState> draw_state;   // complete in application.cpp, where the destructor lives
 
   bool initialization_step;
 };
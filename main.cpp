@@ -1,14 +1,308 @@
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <string>
 
 #include "stadium.h"
+#include "stadium_weld.h"
+#include "stadium_compact.h"
+#include "stadium_encoded.h"
+#include "stadium_bvh.h"
+#include "stadium_refine.h"
+#include "stadium_crop.h"
+#include "stadium_reorder.h"
+#include "stadium_partition.h"
+#include "stadium_chunked.h"
 
 
-void main(){
+static void print_usage(){
+  std::cout << "Usage: StadiumGenerator [--dry-run] [--stream | --mmap | --compact] [--weld] [--hex] [--bvh] [--encode [--tolerance=<t>]]\n"
+            << "                        [--refine-box=<x0,y0,z0,x1,y1,z1> [--refine-level=<n>]] [--crop=<x0,y0,z0,x1,y1,z1>]\n"
+            << "                        [--reorder=<morton|hilbert>] [--parts=<n>] [--index64] [--chunk-bytes=<n>]\n"
+            << "                        [definition file] [output file]\n"
+            << "  --dry-run   reports the point/cell counts, output bytes and expected peak memory\n"
+            << "              without generating anything.\n"
+            << "  --stream    writes the file block by block with memory bounded by the largest block.\n"
+            << "  --mmap      sizes the output file up front and generates every block into it in parallel.\n"
+            << "  --compact   writes only the block descriptors, StadiumCompact expands them on demand (general\n"
+            << "              layout with 32-bit indices, no other output options).\n"
+            << "  --weld      merges the coincident points of neighbouring blocks and layers (in memory).\n"
+            << "  --hex       stores the connectivity as 8 indices per cell without begin indices.\n"
+            << "  --bvh       appends a BVH over the cell boxes, queried in place through StadiumMesh::bvh().\n"
+            << "              The build keeps every cell box in memory (about 64 bytes per cell), also with\n"
+            << "              --stream and --mmap.\n"
+            << "  --encode    writes the delta/varint encoded format, decoded by StadiumEncoded (in memory).\n"
+            << "  --tolerance=<t>  maximum point error of --encode, 0 (the default) is lossless.\n"
+            << "  --refine-box=<x0,y0,z0,x1,y1,z1>  refines the cells around the box (mesh coordinates) with\n"
+            << "              an octree, hanging nodes are listed after the corners (in memory, general layout).\n"
+            << "  --refine-level=<n>  octree levels below a stadium cell, 2 by default, at most 6.\n"
+            << "  --crop=<x0,y0,z0,x1,y1,z1>  generates only the cells intersecting the box (mesh coordinates),\n"
+            << "              renumbered compactly (in memory).\n"
+            << "  --reorder=<morton|hilbert>  sorts the cells and points along a space-filling curve (in memory).\n"
+            << "  --parts=<n> writes n balanced parts with ghost cells and global id maps as <output>.<k>.stadium\n"
+            << "              and <output>.<k>.part (in memory, the halos cross the block seams with --weld).\n"
+            << "  --index64   stores cellPoints and cellPointsBegIndices as 64-bit indices, chosen automatically\n"
+            << "              when the stadium has more than 2^32 points or connectivity entries.\n"
+            << "  --chunk-bytes=<n>  streams the file into pieces of at most n bytes (K, M and G suffixes) listed\n"
+            << "              by <output>.manifest, StadiumManifest reads or reassembles them.\n";
+}
+
+static void print_stadium_sizes(const StadiumSizes& sizes){
+  std::cout << "blocks:               " << sizes.num_blocks << "\n"
+            << "cells:                " << sizes.cellBoxes << "\n"
+            << "cellBoxes:            " << sizes.cellBoxes << "\n"
+            << "points:               " << sizes.points << "\n"
+            << "cellVectors:          " << sizes.cellVectors << "\n"
+            << "cellPoints:           " << sizes.cellPoints << "\n"
+            << "cellPointsBegIndices: " << sizes.cellPointsBegIndices << "\n"
+            << "pointVectors:         " << sizes.pointVectors << "\n"
+            << "cellVolumes:          " << sizes.cellVolumes << "\n"
+            << "output bytes:         " << sizes.output_bytes << "\n"
+            << "peak memory bytes:    " << sizes.peak_bytes << "\n"
+            << "  with --stream:      " << sizes.stream_peak_bytes << "\n";
+}
+
+int main(int argc, char** argv){
+
+  std::string definition_filename = "stadium.def";
+  std::string output_filename     = "test.stadium";
+  bool        dry_run             = false;
+  bool        weld                = false;
+  bool        compact             = false;
+  bool        encode              = false;
+  bool        refine              = false;
+  bool        crop                = false;
+  bool        reorder             = false;
+  uint32_t    num_parts           = 0;
+  size_t      chunk_bytes         = 0;
+
+  StadiumWriteOptions   options;
+  StadiumEncodeOptions  encode_options;
+  StadiumRefineOptions  refine_options;
+  StadiumRefineTarget   refine_target;
+  AABB                  crop_box;
+  StadiumReorderOptions reorder_options;
+
+  int positional = 0;
+  for (int a = 1; a < argc; a++){
+    std::string arg = argv[a];
+    if (arg == "--dry-run")
+      dry_run = true;
+    else if (arg == "--stream")
+      options.mode = STADIUM_OUTPUT_STREAM;
+    else if (arg == "--mmap")
+      options.mode = STADIUM_OUTPUT_MAPPED;
+    else if (arg == "--compact")
+      compact = true;
+    else if (arg == "--weld")
+      weld = true;
+    else if (arg == "--hex")
+      options.flags |= STADIUM_FLAG_HEX8;
+    else if (arg == "--index64")
+      options.flags |= STADIUM_FLAG_INDEX64;
+    else if (arg == "--bvh")
+      options.flags |= STADIUM_FLAG_BVH;
+    else if (arg == "--encode")
+      encode = true;
+    else if (arg.compare(0, 12, "--tolerance=") == 0)
+      encode_options.tolerance = std::strtof(arg.c_str() + 12, 0);
+    else if (arg.compare(0, 13, "--refine-box=") == 0){
+      float b[6];
+      if (std::sscanf(arg.c_str() + 13, "%f,%f,%f,%f,%f,%f", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6){
+        print_usage();
+        return 1;
+      }
+      refine_target.add_box(AABB(float3(b[0], b[1], b[2]), float3(b[3], b[4], b[5])));
+      refine = true;
+    }
+    else if (arg.compare(0, 15, "--refine-level=") == 0){
+      char* end   = 0;
+      long  level = std::strtol(arg.c_str() + 15, &end, 10);
+      if (end == arg.c_str() + 15 || *end != '\0' || level < 0 || level > stadium_refine_max_level){
+        print_usage();
+        return 1;
+      }
+      refine_options.max_level = static_cast<int>(level);
+    }
+    else if (arg.compare(0, 7, "--crop=") == 0){
+      float b[6];
+      if (std::sscanf(arg.c_str() + 7, "%f,%f,%f,%f,%f,%f", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6){
+        print_usage();
+        return 1;
+      }
+      crop_box = AABB(float3(b[0], b[1], b[2]), float3(b[3], b[4], b[5]));
+      crop     = true;
+    }
+    else if (arg == "--reorder=morton" || arg == "--reorder=hilbert"){
+      reorder_options.curve = arg == "--reorder=morton" ? STADIUM_CURVE_MORTON : STADIUM_CURVE_HILBERT;
+      reorder               = true;
+    }
+    else if (arg.compare(0, 8, "--parts=") == 0){
+      num_parts = static_cast<uint32_t>(std::strtoul(arg.c_str() + 8, 0, 10));
+      if (num_parts == 0){
+        print_usage();
+        return 1;
+      }
+    }
+    else if (arg.compare(0, 14, "--chunk-bytes=") == 0){
+      char* suffix = 0;
+      chunk_bytes  = static_cast<size_t>(std::strtoull(arg.c_str() + 14, &suffix, 10));
+      if (*suffix == 'K' || *suffix == 'k')
+        chunk_bytes <<= 10;
+      else if (*suffix == 'M' || *suffix == 'm')
+        chunk_bytes <<= 20;
+      else if (*suffix == 'G' || *suffix == 'g')
+        chunk_bytes <<= 30;
+      if (chunk_bytes == 0){
+        print_usage();
+        return 1;
+      }
+    }
+    else if (arg == "--help" || arg == "-h"){
+      print_usage();
+      return 0;
+    }
+    else if (positional == 0 && arg[0] != '-'){
+      definition_filename = arg;
+      positional++;
+    }
+    else if (positional == 1 && arg[0] != '-'){
+      output_filename = arg;
+      positional++;
+    }
+    else {
+      print_usage();
+      return 1;
+    }
+  }
 
   Stadium stadium;
-  read_stadium_definition("stadium.def", stadium);
-  write_stadium("test.stadium", stadium);
+  if (!read_stadium_definition(definition_filename, stadium))
+    return 1;
+
+  if (dry_run){
+    StadiumSizes sizes;
+    compute_stadium_sizes(stadium, sizes, options.flags);
+    if (sizes.needs_index64() && !(options.flags & STADIUM_FLAG_INDEX64)){
+      std::cout << "the indices overflow 32 bits, the output uses 64-bit indices\n";
+      compute_stadium_sizes(stadium, sizes, options.flags | STADIUM_FLAG_INDEX64);
+    }
+    print_stadium_sizes(sizes);
+    return 0;
+  }
+
+  if (compact){
+    // StadiumCompact expands the general layout with 32-bit indices and no BVH
+    if (options.flags || weld || encode || refine || crop || reorder || num_parts || chunk_bytes){
+      std::cout << "===> --compact cannot be combined with other output options.\n";
+      return 1;
+    }
+    StadiumSizes sizes;
+    compute_stadium_sizes(stadium, sizes, 0);
+    if (sizes.needs_index64()){
+      std::cout << "===> --compact expands to 32-bit indices, this stadium needs 64-bit ones.\n";
+      return 1;
+    }
+    return write_stadium_compact(output_filename, stadium) ? 0 : 1;
+  }
+
+  if (refine && (weld || (options.flags & STADIUM_FLAG_HEX8))){
+    std::cout << "===> --refine-box cannot be combined with --weld or --hex.\n";
+    return 1;
+  }
+
+  if (weld && (options.flags & STADIUM_FLAG_INDEX64)){
+    std::cout << "===> --weld remaps 32-bit indices and cannot be combined with --index64.\n";
+    return 1;
+  }
+
+  if (crop && (weld || refine)){
+    std::cout << "===> --crop cannot be combined with --weld or --refine-box.\n";
+    return 1;
+  }
+
+  if (num_parts && (refine || crop || reorder || encode)){
+    std::cout << "===> --parts cannot be combined with --refine-box, --crop, --reorder or --encode.\n";
+    return 1;
+  }
+
+  bool in_memory = weld || encode || refine || crop || reorder || num_parts;
+
+  if (chunk_bytes && (in_memory || (options.flags & STADIUM_FLAG_BVH))){
+    std::cout << "===> --chunk-bytes only applies to the plain generator output, without --bvh.\n";
+    return 1;
+  }
+
+  if (chunk_bytes)
+    return write_stadium_chunked(output_filename, stadium, chunk_bytes, options) ? 0 : 1;
+
+  // the post-processing stages work on the whole mesh in memory, with 32-bit indices
+  if (in_memory){
+    StadiumSizes sizes;
+    compute_stadium_sizes(stadium, sizes, options.flags);
+    bool overflow = crop ? stadium_crop_needs_index64(stadium, crop_box, options.flags) : sizes.needs_index64();
+    if ((options.flags & STADIUM_FLAG_INDEX64) || overflow){
+      std::cout << "===> The in-memory stages use 32-bit indices, write this stadium without them.\n";
+      return 1;
+    }
+
+    // the encoded format has no BVH section
+    if (encode)
+      options.flags &= ~static_cast<uint32_t>(STADIUM_FLAG_BVH);
+
+    StadiumArrays arrays;
+    if (refine){
+      refine_options.num_threads = options.num_threads;
+      refine_target.build(options.num_threads);
+      size_t refined = 0;
+      if (!refine_stadium(stadium, refine_target, arrays, refined, refine_options)){
+        std::cout << "===> The refined stadium overflows 32-bit indices, use a smaller --refine-box or --refine-level.\n";
+        return 1;
+      }
+      arrays.flags |= options.flags & STADIUM_FLAG_BVH;
+      std::cout << "refine: split " << refined << " cells into " << arrays.cellBoxes.size() << " cells\n";
+    }
+    else if (crop){
+      generate_stadium_crop(stadium, crop_box, arrays, options);
+      std::cout << "crop: " << arrays.cellBoxes.size() << " cells, " << arrays.points.size() << " points\n";
+    }
+    else
+      generate_stadium(stadium, arrays, options);
+
+    if (weld){
+      size_t merged = weld_stadium_points(stadium, arrays, 1.0e-5f, options.num_threads);
+      std::cout << "weld: merged " << merged << " points\n";
+    }
+
+    if (num_parts)
+      return write_stadium_partition(output_filename, stadium, arrays, num_parts, options) ? 0 : 1;
+
+    if (reorder){
+      reorder_options.num_threads = options.num_threads;
+      reorder_stadium(arrays, reorder_options);
+    }
+
+    if (encode){
+      encode_options.num_threads = options.num_threads;
+      return write_stadium_encoded(output_filename, arrays, encode_options) ? 0 : 1;
+    }
+
+    if (!save_stadium(output_filename, arrays))
+      return 1;
+
+    if (options.flags & STADIUM_FLAG_BVH){
+      StadiumBVH bvh;
+      build_stadium_bvh(arrays.cellBoxes.data(), arrays.cellBoxes.size(), bvh, options.num_threads);
+      return append_stadium_bvh(output_filename, bvh) ? 0 : 1;
+    }
+
+    return 0;
+  }
+
+  if (options.flags & STADIUM_FLAG_BVH)
+    return write_stadium_bvh(output_filename, stadium, options) ? 0 : 1;
+
+  return write_stadium(output_filename, stadium, options) ? 0 : 1;
 
-}
\ No newline at end of file
+}
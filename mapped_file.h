@@ -0,0 +1,177 @@
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <string>
+#include <stddef.h>
+
+#ifdef _WIN32
+# ifndef NOMINMAX
+#  define NOMINMAX
+# endif
+# include <Windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+// A whole file mapped into memory, either read-only or created with a fixed size for writing.
+class MappedFile {
+public:
+  MappedFile(){
+    m_data = 0;
+    m_size = 0;
+#ifdef _WIN32
+    m_file    = INVALID_HANDLE_VALUE;
+    m_mapping = 0;
+#else
+    m_fd      = -1;
+#endif
+  }
+
+  ~MappedFile(){
+    close();
+  }
+
+  // Maps an existing file read-only.
+  bool open(const std::string& filename){
+    close();
+
+#ifdef _WIN32
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_file == INVALID_HANDLE_VALUE)
+      return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size)){
+      close();
+      return false;
+    }
+    m_size = static_cast<size_t>(size.QuadPart);
+
+    if (m_size > 0){
+      m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (!m_mapping){
+        close();
+        return false;
+      }
+      m_data = static_cast<char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+#else
+    m_fd = ::open(filename.c_str(), O_RDONLY);
+    if (m_fd < 0)
+      return false;
+
+    struct stat st;
+    if (fstat(m_fd, &st) != 0){
+      close();
+      return false;
+    }
+    m_size = static_cast<size_t>(st.st_size);
+
+    if (m_size > 0){
+      void* data = mmap(0, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+      m_data = data == MAP_FAILED ? 0 : static_cast<char*>(data);
+    }
+#endif
+
+    if (m_size > 0 && !m_data){
+      close();
+      return false;
+    }
+
+    return true;
+  }
+
+  // Creates (or truncates) the file, sizes it to size bytes and maps it for writing.
+  bool create(const std::string& filename, size_t size){
+    close();
+
+    m_size = size;
+
+#ifdef _WIN32
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_file == INVALID_HANDLE_VALUE)
+      return false;
+
+    if (m_size > 0){
+      LARGE_INTEGER li;
+      li.QuadPart = static_cast<LONGLONG>(m_size);
+      m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READWRITE, li.HighPart, li.LowPart, NULL);
+      if (!m_mapping){
+        close();
+        return false;
+      }
+      m_data = static_cast<char*>(MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, 0));
+    }
+#else
+    m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m_fd < 0)
+      return false;
+
+    if (ftruncate(m_fd, static_cast<off_t>(m_size)) != 0){
+      close();
+      return false;
+    }
+
+    if (m_size > 0){
+      void* data = mmap(0, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+      m_data = data == MAP_FAILED ? 0 : static_cast<char*>(data);
+    }
+#endif
+
+    if (m_size > 0 && !m_data){
+      close();
+      return false;
+    }
+
+    return true;
+  }
+
+  // Unmaps the file. Pages written through a writable mapping are left to the OS to write back.
+  bool close(){
+    bool ok = true;
+
+#ifdef _WIN32
+    if (m_data)
+      UnmapViewOfFile(m_data);
+    if (m_mapping)
+      CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE)
+      CloseHandle(m_file);
+    m_mapping = 0;
+    m_file    = INVALID_HANDLE_VALUE;
+#else
+    if (m_data)
+      ok = munmap(m_data, m_size) == 0;
+    if (m_fd >= 0)
+      ok = (::close(m_fd) == 0) && ok;
+    m_fd = -1;
+#endif
+
+    m_data = 0;
+    m_size = 0;
+    return ok;
+  }
+
+  char*       data()        { return m_data; }
+  const char* data()  const { return m_data; }
+  size_t      size()  const { return m_size; }
+
+private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  char*   m_data;
+  size_t  m_size;
+
+#ifdef _WIN32
+  HANDLE  m_file;
+  HANDLE  m_mapping;
+#else
+  int     m_fd;
+#endif
+};
+
+#endif
@@ -1,9 +1,23 @@
 #ifndef __STADIUM_H__
 #define __STADIUM_H__
 
+#include <algorithm>
+#include <charconv>
 #include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <float.h>
 #include <stdint.h>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "mapped_file.h"
+#include "stadium_parallel.h"
+
 struct float3{
   float v[3];
 
@@ -35,198 +49,1304 @@ struct AABB{
 
 };
 
+struct int3{
+  int v[3];
+
+  int3(int v0 = 0, int v1 = 0, int v2 = 0){
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = v2;
+  }
+
+};
+
+// A rows x cols grid of block types, stored row by row at offset in Stadium::layer_type_blocks.
+struct StadiumLayerType {
+  int     rows;
+  int     cols;
+  size_t  offset;
+};
+
 struct Stadium {
-  int                                         num_blocks;
-  int                                         num_layer_types;
-  int                                         num_layers;
-  std::vector<int>                            block_sizes;
-  std::vector<std::vector<std::vector<int>>>  layer_types;
-  std::vector<int>                            layers;
-  std::vector<AABB>                           layer_bbox;
+  int                             num_blocks;
+  int                             num_layer_types;
+  int                             num_layers;
+  std::vector<int3>               block_sizes;        // lattice dims of every block type
+  std::vector<StadiumLayerType>   layer_types;
+  std::vector<int>                layer_type_blocks;  // block types of all layer types, one arena
+  std::vector<int>                layers;
+  std::vector<AABB>               layer_bbox;
+
+  // Block type at row i, column j of a layer type.
+  int block_type(int layer_type, int i, int j) const {
+    const StadiumLayerType& type = layer_types[layer_type];
+    return layer_type_blocks[type.offset + static_cast<size_t>(i) * type.cols + j];
+  }
+
+  const int3& block_dims(int layer_type, int i, int j) const {
+    return block_sizes[block_type(layer_type, i, j)];
+  }
 };
 
-void read_stadium_definition(const std::string& stadium_filename, Stadium& stadium){
-  std::ifstream infile(stadium_filename);
-  if (!infile){
-    std::cout << "===> Cannot open the " << stadium_filename << " file.\n";
-    exit(0);
+// Where and why reading a stadium definition failed. line and column are 1-based, 0 when the
+// error is not tied to a position in the file.
+struct StadiumParseError {
+  int         line;
+  int         column;
+  std::string message;
+
+  StadiumParseError(){
+    line   = 0;
+    column = 0;
   }
+};
+
+// Tokenizer over a memory mapped stadium definition. Numbers are converted in place with
+// std::from_chars and the current line is tracked while skipping white space, so an error can be
+// reported at its position without a second pass.
+class StadiumDefinitionScanner {
+public:
+  StadiumDefinitionScanner(const char* begin, const char* end, StadiumParseError& error) : m_error(error){
+    m_pos        = begin;
+    m_end        = end;
+    m_line_start = begin;
+    m_line       = 1;
+  }
+
+  bool read_int(int& value, const char* what){
+    if (!next_token(what))
+      return false;
+
+    const char* token = m_pos;
+    if (m_pos < m_end && *m_pos == '+')
+      m_pos++;
+    std::from_chars_result result = std::from_chars(m_pos, m_end, value);
+    if (result.ec != std::errc() || !at_separator(result.ptr)){
+      m_pos = token;
+      return fail(std::string("expected an integer for ") + what);
+    }
+    m_pos = result.ptr;
+    return true;
+  }
+
+  bool read_float(float& value, const char* what){
+    if (!next_token(what))
+      return false;
+
+    const char* token = m_pos;
+    if (m_pos < m_end && *m_pos == '+')
+      m_pos++;
+    std::from_chars_result result = std::from_chars(m_pos, m_end, value);
+    if (result.ec != std::errc() || !at_separator(result.ptr)){
+      m_pos = token;
+      return fail(std::string("expected a number for ") + what);
+    }
+    m_pos = result.ptr;
+    return true;
+  }
+
+  // Reads an integer in [lo, hi).
+  bool read_index(int& value, int lo, int hi, const char* what){
+    if (!next_token(what))
+      return false;
+
+    const char* token = m_pos;
+
+    if (!read_int(value, what))
+      return false;
+
+    if (value < lo || value >= hi){
+      m_pos = token;
+      std::ostringstream message;
+      message << what << " " << value << " is out of range [" << lo << ", " << hi << ")";
+      return fail(message.str());
+    }
+    return true;
+  }
+
+  size_t remaining() const {
+    return static_cast<size_t>(m_end - m_pos);
+  }
+
+  bool fail(const std::string& message){
+    m_error.line    = m_line;
+    m_error.column  = static_cast<int>(m_pos - m_line_start) + 1;
+    m_error.message = message;
+    return false;
+  }
+
+private:
+  bool next_token(const char* what){
+    while (m_pos < m_end && (*m_pos == ' ' || *m_pos == '\t' || *m_pos == '\r' || *m_pos == '\n')){
+      if (*m_pos == '\n'){
+        m_line++;
+        m_line_start = m_pos + 1;
+      }
+      m_pos++;
+    }
+
+    if (m_pos == m_end)
+      return fail(std::string("unexpected end of file, expected ") + what);
+
+    return true;
+  }
+
+  bool at_separator(const char* p) const {
+    return p == m_end || *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n';
+  }
+
+  const char*        m_pos;
+  const char*        m_end;
+  const char*        m_line_start;
+  int                m_line;
+  StadiumParseError& m_error;
+};
+
+// Reads a stadium definition. On failure the position and reason are returned in error and the
+// stadium is left partially filled. Every block type and layer type index is checked, so a
+// definition that is read successfully can be generated without out-of-bounds accesses.
+bool read_stadium_definition(const std::string& stadium_filename, Stadium& stadium, StadiumParseError& error){
+  error = StadiumParseError();
+
+  MappedFile infile;
+  if (!infile.open(stadium_filename)){
+    error.message = "cannot open the " + stadium_filename + " file";
+    return false;
+  }
+
+  StadiumDefinitionScanner in(infile.data(), infile.data() + infile.size(), error);
 
   // Read the blocks
-  infile >> stadium.num_blocks;
-  stadium.block_sizes.resize(3 * stadium.num_blocks);
-  for (int i = 0; i < stadium.num_blocks; i++)
-    infile >> stadium.block_sizes[3 * i + 0] >> stadium.block_sizes[3 * i + 1] >> stadium.block_sizes[3 * i + 2];
-  
+  if (!in.read_index(stadium.num_blocks, 0, INT32_MAX, "number of blocks"))
+    return false;
+  if (static_cast<size_t>(stadium.num_blocks) > in.remaining())
+    return in.fail("more blocks than the file can hold");
+
+  stadium.block_sizes.resize(stadium.num_blocks);
+  for (auto& block_size : stadium.block_sizes)
+    for (int d = 0; d < 3; d++)
+      if (!in.read_index(block_size.v[d], 1, INT32_MAX, "block size"))
+        return false;
+
   // Read the layer types
-  infile >> stadium.num_layer_types;
+  if (!in.read_index(stadium.num_layer_types, 0, INT32_MAX, "number of layer types"))
+    return false;
+  if (static_cast<size_t>(stadium.num_layer_types) > in.remaining())
+    return in.fail("more layer types than the file can hold");
+
   stadium.layer_types.resize(stadium.num_layer_types);
+  stadium.layer_type_blocks.clear();
   for (auto& layer_type : stadium.layer_types){
-    int dims[2];
-    infile >> dims[0] >> dims[1];
-    layer_type.resize(dims[0]);
-    for (auto& row : layer_type){
-      row.resize(dims[1]);
-      for (auto& col : row)
-        infile >> col;
-    }
+    if (!in.read_index(layer_type.rows, 1, INT32_MAX, "layer type rows") || !in.read_index(layer_type.cols, 1, INT32_MAX, "layer type columns"))
+      return false;
+    size_t num_cells = static_cast<size_t>(layer_type.rows) * static_cast<size_t>(layer_type.cols);
+    if (num_cells > in.remaining())
+      return in.fail("layer type is larger than the file");
+
+    layer_type.offset = stadium.layer_type_blocks.size();
+    stadium.layer_type_blocks.resize(layer_type.offset + num_cells);
+
+    int* cells = stadium.layer_type_blocks.data() + layer_type.offset;
+    for (size_t k = 0; k < num_cells; k++)
+      if (!in.read_index(cells[k], 0, stadium.num_blocks, "block type"))
+        return false;
   }
 
   // Read the layers
-  infile >> stadium.num_layers;
+  if (!in.read_index(stadium.num_layers, 0, INT32_MAX, "number of layers"))
+    return false;
+  if (static_cast<size_t>(stadium.num_layers) > in.remaining())
+    return in.fail("more layers than the file can hold");
+
   stadium.layers.resize(stadium.num_layers);
   stadium.layer_bbox.resize(stadium.num_layers);
   for (int i = 0; i < stadium.num_layers; i++){
-    infile  >> stadium.layer_bbox[i].min.v[0] >> stadium.layer_bbox[i].min.v[1] >> stadium.layer_bbox[i].min.v[2]
-            >> stadium.layer_bbox[i].max.v[0] >> stadium.layer_bbox[i].max.v[1] >> stadium.layer_bbox[i].max.v[2];
-    infile  >> stadium.layers[i];
+    AABB& bbox = stadium.layer_bbox[i];
+    if (!in.read_float(bbox.min.v[0], "layer box") || !in.read_float(bbox.min.v[1], "layer box") || !in.read_float(bbox.min.v[2], "layer box") ||
+        !in.read_float(bbox.max.v[0], "layer box") || !in.read_float(bbox.max.v[1], "layer box") || !in.read_float(bbox.max.v[2], "layer box"))
+      return false;
+    if (!in.read_index(stadium.layers[i], 0, stadium.num_layer_types, "layer type"))
+      return false;
   }
+
+  return true;
 }
 
-bool write_stadium(const std::string& filename, const Stadium& stadium){
+// Reads a stadium definition and reports a failure on the console.
+bool read_stadium_definition(const std::string& stadium_filename, Stadium& stadium){
+  StadiumParseError error;
+  if (read_stadium_definition(stadium_filename, stadium, error))
+    return true;
 
-  std::ofstream out(filename.c_str(), std::ios_base::binary);
+  if (error.line > 0)
+    std::cout << "===> " << stadium_filename << ":" << error.line << ":" << error.column << ": " << error.message << ".\n";
+  else
+    std::cout << "===> " << error.message << ".\n";
+  return false;
+}
 
-  if (out)
-  {
+// Scale applied to every generated point.
+static const float stadium_len[3] = { 0.25f, 0.25f, 0.25f };
+
+// Layout flags of a .stadium file. A file with flags starts with a "STADIUM <flags>" line in front
+// of the count header, files without that line use the general layout.
+enum StadiumFileFlags {
+  STADIUM_FLAG_HEX8    = 1,   // pure-hex mesh: 8 point indices per cell in cellPoints, no begin indices
+  STADIUM_FLAG_BVH     = 2,   // a BVH section over the cell boxes follows the arrays, see stadium_bvh.h
+  STADIUM_FLAG_INDEX64 = 4    // cellPoints and cellPointsBegIndices hold uint64_t instead of uint32_t
+};
+
+// Size of one cellPoints or cellPointsBegIndices entry.
+inline size_t stadium_index_bytes(uint32_t flags){
+  return (flags & STADIUM_FLAG_INDEX64) ? sizeof(uint64_t) : sizeof(uint32_t);
+}
+
+// One (layer, i, j) block of the stadium. first_point and first_cell are the exclusive prefix sums
+// of the point and cell counts of all the blocks before it, so every block knows where its data
+// lands in the output arrays before anything is generated.
+struct StadiumBlock {
+  int       layer;
+  int       i, j;
+  uint32_t  block_type;
+  int       dims[3];
+  float     offset[3];
+  float     elem_dim[3];
+  size_t    first_point;
+  size_t    first_cell;
+
+  size_t num_points() const {
+    return static_cast<size_t>(dims[0] + 1) * (dims[1] + 1) * (dims[2] + 1);
+  }
+
+  size_t num_cells() const {
+    return static_cast<size_t>(dims[0]) * dims[1] * dims[2];
+  }
+
+  // Coordinate of the lattice plane d along the given axis.
+  float coord(int axis, int d) const {
+    float local = static_cast<float>(d) / static_cast<float>(dims[axis]);
+    return (offset[axis] + local * elem_dim[axis]) * stadium_len[axis];
+  }
+};
+
+// Sets up block (i, j) of layer l, all but first_point and first_cell.
+void init_stadium_block(const Stadium& stadium, int l, int i, int j, StadiumBlock& block){
+  float layer_dim[3] = {
+    stadium.layer_bbox[l].max.v[0] - stadium.layer_bbox[l].min.v[0],
+    stadium.layer_bbox[l].max.v[1] - stadium.layer_bbox[l].min.v[1],
+    stadium.layer_bbox[l].max.v[2] - stadium.layer_bbox[l].min.v[2]
+  };
+
+  const StadiumLayerType& layer_type  = stadium.layer_types[stadium.layers[l]];
+  const int*              block_types = stadium.layer_type_blocks.data() + layer_type.offset;
+
+  block.layer = l;
+  block.i     = i;
+  block.j     = j;
+
+  block.elem_dim[0] = 1.0f / static_cast<float>(layer_type.rows) * layer_dim[0];
+  block.elem_dim[1] = 1.0f / static_cast<float>(layer_type.cols) * layer_dim[1];
+  block.elem_dim[2] = layer_dim[2];
+
+  block.offset[0] = stadium.layer_bbox[l].min.v[0] + static_cast<float>(i)* block.elem_dim[0];
+  block.offset[1] = stadium.layer_bbox[l].min.v[1] + static_cast<float>(j)* block.elem_dim[1];
+  block.offset[2] = stadium.layer_bbox[l].min.v[2];
+
+  block.block_type = block_types[static_cast<size_t>(i) * layer_type.cols + j];
+  block.dims[0] = stadium.block_sizes[block.block_type].v[0];
+  block.dims[1] = stadium.block_sizes[block.block_type].v[1];
+  block.dims[2] = stadium.block_sizes[block.block_type].v[2];
+
+  block.first_point = 0;
+  block.first_cell  = 0;
+}
+
+// Builds the block list of the stadium in generation order (layers -> rows -> columns).
+void compute_stadium_blocks(const Stadium& stadium, std::vector<StadiumBlock>& blocks){
+  blocks.clear();
+
+  size_t num_points = 0;
+  size_t num_cells  = 0;
+
+  for (int l = 0; l < stadium.num_layers; l++){
+    const StadiumLayerType& layer_type = stadium.layer_types[stadium.layers[l]];
+
+    for (int i = 0; i < layer_type.rows; i++){
+      for (int j = 0; j < layer_type.cols; j++){
+        StadiumBlock block;
+        init_stadium_block(stadium, l, i, j, block);
+
+        block.first_point = num_points;
+        block.first_cell  = num_cells;
+
+        num_points += block.num_points();
+        num_cells  += block.num_cells();
+
+        blocks.push_back(block);
+      }
+    }
+  }
+}
+
+// Position of the blocks of every layer in a list built by compute_stadium_blocks, so the
+// neighbours of a block are found by (layer, i, j).
+struct StadiumBlockGrid {
+  std::vector<size_t> layer_first;    // first block of every layer
+  std::vector<int>    layer_cols;
+
+  size_t index(int layer, int i, int j) const {
+    return layer_first[layer] + static_cast<size_t>(i) * layer_cols[layer] + j;
+  }
+};
+
+void compute_stadium_block_grid(const std::vector<StadiumBlock>& blocks, StadiumBlockGrid& grid){
+  int num_layers = blocks.empty() ? 0 : blocks.back().layer + 1;
+
+  grid.layer_first.assign(num_layers, blocks.size());
+  grid.layer_cols.assign(num_layers, 0);
+  for (size_t b = blocks.size(); b-- > 0;){
+    grid.layer_first[blocks[b].layer] = b;
+    grid.layer_cols[blocks[b].layer]  = std::max(grid.layer_cols[blocks[b].layer], blocks[b].j + 1);
+  }
+}
+
+// Which faces of a block are shared with the previous block along i (bit 0) and along j (bit 1):
+// the neighbour lattice conforms on the shared face, so the face points and edges coincide.
+enum StadiumSeam {
+  STADIUM_SEAM_I = 1,
+  STADIUM_SEAM_J = 2
+};
+
+// Seam bits of every block of the list built by compute_stadium_blocks. Seams between stacked
+// layers and between blocks of different sizes do not line up point for point and are not marked.
+void compute_stadium_seams(const std::vector<StadiumBlock>& blocks, const StadiumBlockGrid& grid, std::vector<uint8_t>& seams){
+  seams.assign(blocks.size(), 0);
+  for (size_t b = 0; b < blocks.size(); b++){
+    const StadiumBlock& block = blocks[b];
+    const int*          dims  = block.dims;
+
+    if (block.i > 0){
+      const StadiumBlock& prev = blocks[grid.index(block.layer, block.i - 1, block.j)];
+      if (prev.dims[1] == dims[1] && prev.dims[2] == dims[2])
+        seams[b] |= STADIUM_SEAM_I;
+    }
+
+    if (block.j > 0){
+      const StadiumBlock& prev = blocks[grid.index(block.layer, block.i, block.j - 1)];
+      if (prev.dims[0] == dims[0] && prev.dims[2] == dims[2])
+        seams[b] |= STADIUM_SEAM_J;
+    }
+  }
+}
+
+// Calls fn(k, p) for the (dims+1)^3 lattice points of the block in generation order, k being the
+// index inside the block. The lattice planes are computed once per block, so the loop itself only
+// loads them.
+template <typename Fn>
+inline void for_each_block_point(const StadiumBlock& block, Fn fn){
+  std::vector<float> planes(block.dims[0] + block.dims[1] + block.dims[2] + 3);
+  float* xs = planes.data();
+  float* ys = xs + block.dims[0] + 1;
+  float* zs = ys + block.dims[1] + 1;
+  for (int d = 0; d <= block.dims[0]; d++) xs[d] = block.coord(0, d);
+  for (int d = 0; d <= block.dims[1]; d++) ys[d] = block.coord(1, d);
+  for (int d = 0; d <= block.dims[2]; d++) zs[d] = block.coord(2, d);
+
+  size_t k = 0;
+  for (int d0 = 0; d0 <= block.dims[0]; d0++)
+    for (int d1 = 0; d1 <= block.dims[1]; d1++)
+      for (int d2 = 0; d2 <= block.dims[2]; d2++)
+        fn(k++, float3(xs[d0], ys[d1], zs[d2]));
+}
+
+// Writes the (dims+1)^3 lattice points of the block to points[0 .. block.num_points()).
+void generate_block_points(const StadiumBlock& block, float3* points){
+  for_each_block_point(block, [points](size_t k, const float3& p){
+    points[k] = p;
+  });
+}
+
+// Writes the hexahedra of the block. cellPoints and cellPointsBegIndices point at the first entry
+// of the block, the stored indices are global.
+void generate_block_cells(const StadiumBlock& block, uint32_t* cellPoints, uint32_t* cellPointsBegIndices){
+  const int* dims = block.dims;
+
+  // the indices are computed in size_t, only the stored values are 32-bit
+  size_t s1 = static_cast<size_t>(dims[2] + 1);
+  size_t s0 = static_cast<size_t>(dims[1] + 1) * s1;
+
+  size_t k = 0;
+  for (int d0 = 0; d0 < dims[0]; d0++)
+    for (int d1 = 0; d1 < dims[1]; d1++)
+      for (int d2 = 0; d2 < dims[2]; d2++){
+
+        size_t p0 = block.first_point +  d0      * s0 +  d1      * s1 + d2;
+        size_t p1 = block.first_point + (d0 + 1) * s0 +  d1      * s1 + d2;
+        size_t p2 = block.first_point + (d0 + 1) * s0 +  d1      * s1 + d2 + 1;
+        size_t p3 = block.first_point +  d0      * s0 +  d1      * s1 + d2 + 1;
+        size_t p4 = block.first_point +  d0      * s0 + (d1 + 1) * s1 + d2;
+        size_t p5 = block.first_point + (d0 + 1) * s0 + (d1 + 1) * s1 + d2;
+        size_t p6 = block.first_point + (d0 + 1) * s0 + (d1 + 1) * s1 + d2 + 1;
+        size_t p7 = block.first_point +  d0      * s0 + (d1 + 1) * s1 + d2 + 1;
+
+        cellPointsBegIndices[k] = static_cast<uint32_t>(9 * (block.first_cell + k));
+
+        uint32_t* cell = cellPoints + 9 * k;
+        cell[0] = 8;
+        cell[1] = static_cast<uint32_t>(p0);
+        cell[2] = static_cast<uint32_t>(p1);
+        cell[3] = static_cast<uint32_t>(p2);
+        cell[4] = static_cast<uint32_t>(p3);
+        cell[5] = static_cast<uint32_t>(p4);
+        cell[6] = static_cast<uint32_t>(p5);
+        cell[7] = static_cast<uint32_t>(p6);
+        cell[8] = static_cast<uint32_t>(p7);
+
+        k++;
+      }
+}
+
+// Writes the hexahedra of the block in the fixed-stride hex layout, 8 global point indices per cell
+// without the count and without begin indices. cellPoints points at the first entry of the block.
+void generate_block_hex_cells(const StadiumBlock& block, uint32_t* cellPoints){
+  const int* dims = block.dims;
+
+  size_t s1 = static_cast<size_t>(dims[2] + 1);
+  size_t s0 = static_cast<size_t>(dims[1] + 1) * s1;
+
+  uint32_t* cell = cellPoints;
+  for (int d0 = 0; d0 < dims[0]; d0++)
+    for (int d1 = 0; d1 < dims[1]; d1++)
+      for (int d2 = 0; d2 < dims[2]; d2++){
+        uint32_t p0 = static_cast<uint32_t>(block.first_point + d0 * s0 + d1 * s1 + d2);
+
+        cell[0] = p0;
+        cell[1] = static_cast<uint32_t>(p0 + s0);
+        cell[2] = static_cast<uint32_t>(p0 + s0 + 1);
+        cell[3] = p0 + 1;
+        cell[4] = static_cast<uint32_t>(p0 + s1);
+        cell[5] = static_cast<uint32_t>(p0 + s0 + s1);
+        cell[6] = static_cast<uint32_t>(p0 + s0 + s1 + 1);
+        cell[7] = static_cast<uint32_t>(p0 + s1 + 1);
+        cell += 8;
+      }
+}
+
+// dst[k] = src[k] + offset for k in [0, count).
+inline void stadium_add_offset(const uint32_t* src, size_t count, uint32_t offset, uint32_t* dst){
+  size_t k = 0;
+#ifdef __AVX2__
+  const __m256i off = _mm256_set1_epi32(static_cast<int>(offset));
+  for (; k + 8 <= count; k += 8)
+    _mm256_storeu_si256((__m256i*)(dst + k), _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(src + k)), off));
+#endif
+  for (; k < count; k++)
+    dst[k] = src[k] + offset;
+}
+
+// dst[k] = src[k] + offset for k in [0, count), widened to 64 bits.
+inline void stadium_add_offset(const uint32_t* src, size_t count, uint64_t offset, uint64_t* dst){
+  size_t k = 0;
+#ifdef __AVX2__
+  const __m256i off = _mm256_set1_epi64x(static_cast<long long>(offset));
+  for (; k + 4 <= count; k += 4)
+    _mm256_storeu_si256((__m256i*)(dst + k), _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(src + k))), off));
+#endif
+  for (; k < count; k++)
+    dst[k] = src[k] + offset;
+}
+
+// Block-local connectivity of every block type used by a stadium, in one layout. All blocks of a
+// type share their connectivity up to first_point, so it is generated once per type and every
+// block is emitted by adding its offset to the template.
+struct StadiumCellTemplates {
+  uint32_t                            flags;      // StadiumFileFlags of the templates
+  std::vector<std::vector<uint32_t> > cellPoints; // per block type, empty for unused types
+
+  StadiumCellTemplates(){
+    flags = 0;
+  }
+
+  size_t bytes() const {
+    size_t total = 0;
+    for (const auto& cells : cellPoints)
+      total += sizeof(uint32_t) * cells.size();
+    return total;
+  }
+};
+
+// Generates the templates of the block types referenced by the layers of the stadium.
+void build_stadium_cell_templates(const Stadium& stadium, uint32_t flags, StadiumCellTemplates& templates, unsigned num_threads = 0){
+  templates.flags = flags;
+  templates.cellPoints.assign(stadium.num_blocks, std::vector<uint32_t>());
+
+  std::vector<bool> used(stadium.num_blocks, false);
+  std::vector<bool> type_used(stadium.num_layer_types, false);
+  for (int l = 0; l < stadium.num_layers; l++){
+    if (type_used[stadium.layers[l]])
+      continue;
+    type_used[stadium.layers[l]] = true;
+
+    const StadiumLayerType& layer_type = stadium.layer_types[stadium.layers[l]];
+    const int*              cells      = stadium.layer_type_blocks.data() + layer_type.offset;
+    for (size_t k = 0; k < static_cast<size_t>(layer_type.rows) * layer_type.cols; k++)
+      used[cells[k]] = true;
+  }
+
+  std::vector<uint32_t> block_types;
+  for (int t = 0; t < stadium.num_blocks; t++)
+    if (used[t])
+      block_types.push_back(static_cast<uint32_t>(t));
+
+  parallel_for(0, block_types.size(), num_threads, [&](size_t k){
+    StadiumBlock block = StadiumBlock();
+    block.block_type = block_types[k];
+    for (int a = 0; a < 3; a++)
+      block.dims[a] = stadium.block_sizes[block.block_type].v[a];
+
+    std::vector<uint32_t>& cells = templates.cellPoints[block.block_type];
+    if (flags & STADIUM_FLAG_HEX8){
+      cells.resize(8 * block.num_cells());
+      generate_block_hex_cells(block, cells.data());
+    }
+    else {
+      std::vector<uint32_t> beg_indices(block.num_cells());
+      cells.resize(9 * block.num_cells());
+      generate_block_cells(block, cells.data(), beg_indices.data());
+    }
+  });
+}
+
+// Same output as generate_block_cells / generate_block_hex_cells, from the template of the block
+// type. In the general layout the count entries are restored after the offset add, a chunk of
+// cells at a time while it is still in cache. Either output may be null. Index is uint32_t, or
+// uint64_t for STADIUM_FLAG_INDEX64; the templates stay block-local and 32-bit in both cases.
+template <typename Index>
+void emit_block_cells_as(const StadiumBlock& block, const StadiumCellTemplates& templates, Index* cellPoints, Index* cellPointsBegIndices){
+  const std::vector<uint32_t>& cells  = templates.cellPoints[block.block_type];
+  Index                        offset = static_cast<Index>(block.first_point);
+  size_t                       count  = block.num_cells();
+
+  if (templates.flags & STADIUM_FLAG_HEX8){
+    if (cellPoints)
+      stadium_add_offset(cells.data(), 8 * count, offset, cellPoints);
+    return;
+  }
+
+  if (cellPoints){
+    const size_t chunk = 1024;
+    for (size_t first = 0; first < count; first += chunk){
+      size_t n = std::min(chunk, count - first);
+      stadium_add_offset(cells.data() + 9 * first, 9 * n, offset, cellPoints + 9 * first);
+      for (size_t k = first; k < first + n; k++)
+        cellPoints[9 * k] = 8;
+    }
+  }
+
+  if (cellPointsBegIndices){
+    Index offset_cells = static_cast<Index>(9 * block.first_cell);
+    for (size_t k = 0; k < count; k++)
+      cellPointsBegIndices[k] = offset_cells + static_cast<Index>(9 * k);
+  }
+}
+
+void emit_block_cells(const StadiumBlock& block, const StadiumCellTemplates& templates, uint32_t* cellPoints, uint32_t* cellPointsBegIndices){
+  emit_block_cells_as(block, templates, cellPoints, cellPointsBegIndices);
+}
 
-    std::vector<AABB>     cellBoxes;
-    std::vector<float3>   points;
-    std::vector<float3>   cellVectors;
-    std::vector<uint32_t> cellPoints;
-    std::vector<uint32_t> cellPointsBegIndices;
-    std::vector<float3>   pointVectors;
-    std::vector<float>    cellVolumes;
+void emit_block_cells(const StadiumBlock& block, const StadiumCellTemplates& templates, uint64_t* cellPoints, uint64_t* cellPointsBegIndices){
+  emit_block_cells_as(block, templates, cellPoints, cellPointsBegIndices);
+}
 
-    float len[] = { 0.25f, 0.25f, 0.25f };
+static_assert(sizeof(AABB) == 6 * sizeof(float), "AABB is written as six packed floats");
 
-    for (int l = 0; l < stadium.num_layers; l++){
-      float layer_dim[3] = {
-        stadium.layer_bbox[l].max.v[0] - stadium.layer_bbox[l].min.v[0],
-        stadium.layer_bbox[l].max.v[1] - stadium.layer_bbox[l].min.v[1],
-        stadium.layer_bbox[l].max.v[2] - stadium.layer_bbox[l].min.v[2]
-      };
+// Volume of a cell from its extents.
+inline float stadium_cell_volume(float dx, float dy, float dz){
+  return dz * (dx * dy);
+}
 
-      float  elem_dim_z = layer_dim[2];
-      float  offset_z = stadium.layer_bbox[l].min.v[2]; // static_cast<float>(l) / (stadium.num_layers - 1);
+// Writes the boxes and volumes of the block cells in generation order. Both follow from the lattice
+// planes of the block, so nothing is gathered through the connectivity: every (d0, d1) row shares
+// its x and y ranges and only z changes along the row. The rows are vectorized with AVX2 when
+// available. Either output may be null.
+void generate_block_boxes_volumes(const StadiumBlock& block, AABB* cellBoxes, float* cellVolumes){
+  const int* dims = block.dims;
 
-      size_t offset_cellBoxes = cellBoxes.size();
+  // lattice planes, z padded for the 8-wide loads
+  std::vector<float> xs(dims[0] + 1), ys(dims[1] + 1), zs(dims[2] + 1 + 8);
+  for (int d = 0; d <= dims[0]; d++) xs[d] = block.coord(0, d);
+  for (int d = 0; d <= dims[1]; d++) ys[d] = block.coord(1, d);
+  for (int d = 0; d <= dims[2]; d++) zs[d] = block.coord(2, d);
+  for (int d = dims[2] + 1; d < dims[2] + 1 + 8; d++) zs[d] = zs[dims[2]];
 
-      size_t offset_cellVectors = cellVectors.size();
+#ifdef __AVX2__
+  // the z planes are non-decreasing, so the box of cell d2 spans [zs[d2], zs[d2 + 1]]
+  bool z_ascending = block.elem_dim[2] >= 0.0f;
+#endif
 
+  size_t k = 0;
+  for (int d0 = 0; d0 < dims[0]; d0++)
+    for (int d1 = 0; d1 < dims[1]; d1++){
+      float x0 = std::min(xs[d0], xs[d0 + 1]), x1 = std::max(xs[d0], xs[d0 + 1]);
+      float y0 = std::min(ys[d1], ys[d1 + 1]), y1 = std::max(ys[d1], ys[d1 + 1]);
 
-      int layer_type = stadium.layers[l];
+      int d2 = 0;
 
-      for (size_t i = 0; i < stadium.layer_types[layer_type].size(); i++){
-        for (size_t j = 0; j < stadium.layer_types[layer_type][i].size(); j++){
+#ifdef __AVX2__
+      if (z_ascending){
+        if (cellBoxes){
+          // four boxes are 24 floats: x0 y0 z0 x1 y1 z1 | x0 y0 z1 x1 y1 z2 | ...
+          const __m256  t0 = _mm256_setr_ps(x0, y0, 0.0f, x1, y1, 0.0f, x0, y0);
+          const __m256  t1 = _mm256_setr_ps(0.0f, x1, y1, 0.0f, x0, y0, 0.0f, x1);
+          const __m256  t2 = _mm256_setr_ps(y1, 0.0f, x0, y0, 0.0f, x1, y1, 0.0f);
+          const __m256i i0 = _mm256_setr_epi32(0, 0, 0, 0, 0, 1, 0, 0);
+          const __m256i i1 = _mm256_setr_epi32(1, 0, 0, 2, 0, 0, 2, 0);
+          const __m256i i2 = _mm256_setr_epi32(0, 3, 0, 0, 3, 0, 0, 4);
 
-          float elem_dim_x = 1.0f / static_cast<float>(stadium.layer_types[layer_type].size()) * layer_dim[0];
-          float elem_dim_y = 1.0f / static_cast<float>(stadium.layer_types[layer_type][i].size()) * layer_dim[1];
+          for (int z = 0; z + 4 <= dims[2]; z += 4){
+            __m256 zv  = _mm256_loadu_ps(&zs[z]);
+            float* out = (float*)(cellBoxes + k + z);
+            _mm256_storeu_ps(out +  0, _mm256_blend_ps(t0, _mm256_permutevar8x32_ps(zv, i0), 0x24));
+            _mm256_storeu_ps(out +  8, _mm256_blend_ps(t1, _mm256_permutevar8x32_ps(zv, i1), 0x49));
+            _mm256_storeu_ps(out + 16, _mm256_blend_ps(t2, _mm256_permutevar8x32_ps(zv, i2), 0x92));
+          }
+        }
 
-          float offset_x = stadium.layer_bbox[l].min.v[0] + static_cast<float>(i)* elem_dim_x;
-          float offset_y = stadium.layer_bbox[l].min.v[1] + static_cast<float>(j)* elem_dim_y;
+        if (cellVolumes){
+          const __m256 area = _mm256_set1_ps((x1 - x0) * (y1 - y0));
+          for (int z = 0; z + 8 <= dims[2]; z += 8){
+            __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&zs[z + 1]), _mm256_loadu_ps(&zs[z]));
+            _mm256_storeu_ps(cellVolumes + k + z, _mm256_mul_ps(dz, area));
+          }
+        }
 
-          uint32_t block_type = stadium.layer_types[layer_type][i][j];
-          int dims[3] = { stadium.block_sizes[3 * block_type + 0], stadium.block_sizes[3 * block_type + 1], stadium.block_sizes[3 * block_type + 2] };
+        // the scalar tail starts after the shorter of the two vector loops
+        d2 = cellVolumes ? (dims[2] / 8) * 8 : (dims[2] / 4) * 4;
+        if (cellBoxes)
+          d2 = std::min(d2, (dims[2] / 4) * 4);
+      }
+#endif
 
-          uint32_t offset_points = static_cast<uint32_t>(points.size());
+      for (; d2 < dims[2]; d2++){
+        float z0 = std::min(zs[d2], zs[d2 + 1]), z1 = std::max(zs[d2], zs[d2 + 1]);
 
-          // Generating the points
-          for (int d0 = 0; d0 <= dims[0]; d0++)
-            for (int d1 = 0; d1 <= dims[1]; d1++)
-              for (int d2 = 0; d2 <= dims[2]; d2++){
+        if (cellBoxes)
+          cellBoxes[k + d2] = AABB(float3(x0, y0, z0), float3(x1, y1, z1));
+        if (cellVolumes)
+          cellVolumes[k + d2] = stadium_cell_volume(x1 - x0, y1 - y0, z1 - z0);
+      }
 
-                float local_x = static_cast<float>(d0) / static_cast<float>(dims[0]);
-                float local_y = static_cast<float>(d1) / static_cast<float>(dims[1]);
-                float local_z = static_cast<float>(d2) / static_cast<float>(dims[2]);
+      k += dims[2];
+    }
+}
+
+// The seven arrays of a .stadium file.
+struct StadiumArrays {
+  std::vector<AABB>     cellBoxes;
+  std::vector<float3>   points;
+  std::vector<float3>   cellVectors;
+  std::vector<uint32_t> cellPoints;
+  std::vector<uint32_t> cellPointsBegIndices;
+  std::vector<float3>   pointVectors;
+  std::vector<float>    cellVolumes;
+  uint32_t              flags;      // StadiumFileFlags of the connectivity layout
+
+  StadiumArrays(){
+    flags = 0;
+  }
+};
 
-                float x = (offset_x + local_x * elem_dim_x) * len[0];
-                float y = (offset_y + local_y * elem_dim_y) * len[1];
-                float z = (offset_z + local_z * elem_dim_z) * len[2];
+// Exact element counts of the seven arrays of a stadium and the memory needed to produce them.
+struct StadiumSizes {
+  size_t num_blocks;
+  size_t cellBoxes;
+  size_t points;
+  size_t cellVectors;
+  size_t cellPoints;
+  size_t cellPointsBegIndices;
+  size_t pointVectors;
+  size_t cellVolumes;
 
-                points.push_back(float3(x, y, z));
-              }
+  size_t max_block_points;
+  size_t max_block_cells;
+  size_t template_cells;      // cells of the distinct block types, see StadiumCellTemplates
 
-          // Adding the points to the lists
-          for (int d0 = 0; d0 < dims[0]; d0++)
-            for (int d1 = 0; d1 < dims[1]; d1++)
-              for (int d2 = 0; d2 < dims[2]; d2++){
+  uint32_t flags;             // StadiumFileFlags
+  size_t header_bytes;        // text count header
+  size_t output_bytes;        // whole .stadium file
+  size_t peak_bytes;          // expected peak resident memory of generate_stadium + save_stadium
+  size_t stream_peak_bytes;   // expected peak resident memory of write_stadium_streaming
 
-                int p0 = (offset_points +  d0      * (dims[1] + 1) * (dims[2] + 1) +  d1       * (dims[2] + 1) + d2    );
-                int p1 = (offset_points + (d0 + 1) * (dims[1] + 1) * (dims[2] + 1) +  d1       * (dims[2] + 1) + d2    );
-                int p2 = (offset_points + (d0 + 1) * (dims[1] + 1) * (dims[2] + 1) +  d1       * (dims[2] + 1) + d2 + 1);
-                int p3 = (offset_points +  d0      * (dims[1] + 1) * (dims[2] + 1) +  d1       * (dims[2] + 1) + d2 + 1);
-                int p4 = (offset_points +  d0      * (dims[1] + 1) * (dims[2] + 1) + (d1 + 1)  * (dims[2] + 1) + d2    );
-                int p5 = (offset_points + (d0 + 1) * (dims[1] + 1) * (dims[2] + 1) + (d1 + 1)  * (dims[2] + 1) + d2    );
-                int p6 = (offset_points + (d0 + 1) * (dims[1] + 1) * (dims[2] + 1) + (d1 + 1)  * (dims[2] + 1) + d2 + 1);
-                int p7 = (offset_points +  d0      * (dims[1] + 1) * (dims[2] + 1) + (d1 + 1)  * (dims[2] + 1) + d2 + 1);
+  StadiumSizes(){
+    num_blocks = cellBoxes = points = cellVectors = cellPoints = cellPointsBegIndices = pointVectors = cellVolumes = 0;
+    max_block_points = max_block_cells = template_cells = 0;
+    flags = 0;
+    header_bytes = output_bytes = peak_bytes = stream_peak_bytes = 0;
+  }
+
+  size_t array_bytes() const {
+    return sizeof(AABB)     * cellBoxes
+         + sizeof(float3)   * points
+         + sizeof(float3)   * cellVectors
+         + stadium_index_bytes(flags) * cellPoints
+         + stadium_index_bytes(flags) * cellPointsBegIndices
+         + sizeof(float3)   * pointVectors
+         + sizeof(float)    * cellVolumes;
+  }
+
+  // Whether a point index or a connectivity offset needs STADIUM_FLAG_INDEX64.
+  bool needs_index64() const {
+    return points > UINT32_MAX || cellPoints > UINT32_MAX;
+  }
+};
+
+// Size of the buffer used by the streaming writer for the constant sections.
+static const size_t stadium_stream_buffer_bytes = 1 << 20;
+
+// Length of a count line of the text header, digits plus the new line.
+inline size_t stadium_header_line_bytes(size_t count){
+  size_t digits = 1;
+  while (count >= 10){
+    count /= 10;
+    digits++;
+  }
+  return digits + 1;
+}
 
-                cellPointsBegIndices.push_back(static_cast<uint32_t>(cellPoints.size()));
-                cellPoints.push_back(8);
-                cellPoints.push_back(p0);
-                cellPoints.push_back(p1);
-                cellPoints.push_back(p2);
-                cellPoints.push_back(p3);
-                cellPoints.push_back(p4);
-                cellPoints.push_back(p5);
-                cellPoints.push_back(p6);
-                cellPoints.push_back(p7);
-            }
+// Length of the "STADIUM <flags>" line, none for the general layout.
+inline size_t stadium_tag_line_bytes(uint32_t flags){
+  return flags ? 8 + stadium_header_line_bytes(flags) : 0;
+}
+
+// Length of the text count header of sizes without padding.
+inline size_t stadium_unpadded_header_bytes(const StadiumSizes& sizes){
+  return stadium_tag_line_bytes(sizes.flags)
+       + stadium_header_line_bytes(sizes.cellBoxes)
+       + stadium_header_line_bytes(sizes.points)
+       + stadium_header_line_bytes(sizes.cellVectors)
+       + stadium_header_line_bytes(sizes.cellPoints)
+       + stadium_header_line_bytes(sizes.cellPointsBegIndices)
+       + stadium_header_line_bytes(sizes.pointVectors)
+       + stadium_header_line_bytes(sizes.cellVolumes);
+}
+
+// Leading zeros written in front of the first count so the arrays are aligned in the file: every
+// section starts on a multiple of 4 bytes, the 64-bit connectivity on a multiple of 8.
+inline size_t stadium_header_padding(const StadiumSizes& sizes){
+  size_t before = stadium_index_bytes(sizes.flags) == 8 ? sizeof(AABB) * sizes.cellBoxes + sizeof(float3) * (sizes.points + sizes.cellVectors) : 0;
+  return (8 - (stadium_unpadded_header_bytes(sizes) + before) % 8) % 8;
+}
+
+// Length of the text count header of sizes, padding included.
+inline size_t stadium_header_bytes(const StadiumSizes& sizes){
+  return stadium_unpadded_header_bytes(sizes) + stadium_header_padding(sizes);
+}
+
+// Counting pass over the definition, nothing is generated.
+void compute_stadium_sizes(const Stadium& stadium, StadiumSizes& sizes, uint32_t flags = 0){
+  sizes = StadiumSizes();
+  sizes.flags = flags;
+
+  // every layer type is counted once, the layers only add up their totals
+  std::vector<size_t> type_points(stadium.num_layer_types, 0);
+  std::vector<size_t> type_cells(stadium.num_layer_types, 0);
+  std::vector<bool>   type_used(stadium.num_layer_types, false);
+  std::vector<bool>   block_used(stadium.num_blocks, false);
+  for (int l = 0; l < stadium.num_layers; l++)
+    type_used[stadium.layers[l]] = true;
+
+  for (int t = 0; t < stadium.num_layer_types; t++){
+    if (!type_used[t])
+      continue;
+
+    const StadiumLayerType& layer_type = stadium.layer_types[t];
+    const int*              cells      = stadium.layer_type_blocks.data() + layer_type.offset;
+    for (size_t k = 0; k < static_cast<size_t>(layer_type.rows) * layer_type.cols; k++){
+      const int* dims = stadium.block_sizes[cells[k]].v;
+      size_t block_points = static_cast<size_t>(dims[0] + 1) * (dims[1] + 1) * (dims[2] + 1);
+      size_t block_cells  = static_cast<size_t>(dims[0]) * dims[1] * dims[2];
+
+      type_points[t] += block_points;
+      type_cells[t]  += block_cells;
+
+      sizes.max_block_points = std::max(sizes.max_block_points, block_points);
+      sizes.max_block_cells  = std::max(sizes.max_block_cells, block_cells);
+
+      if (!block_used[cells[k]]){
+        block_used[cells[k]] = true;
+        sizes.template_cells += block_cells;
       }
     }
   }
 
-    // setting the cell volumes and vectors
-    cellVectors.resize(cellPointsBegIndices.size());
-    cellVolumes.resize(cellVectors.size());
-    for (auto& cell_vector : cellVectors)
-      cell_vector = float3(0.0f, 0.0f, 1.0f);
+  size_t num_points = 0;
+  size_t num_cells  = 0;
+
+  for (int l = 0; l < stadium.num_layers; l++){
+    const StadiumLayerType& layer_type = stadium.layer_types[stadium.layers[l]];
+    num_points       += type_points[stadium.layers[l]];
+    num_cells        += type_cells[stadium.layers[l]];
+    sizes.num_blocks += static_cast<size_t>(layer_type.rows) * layer_type.cols;
+  }
+
+  sizes.cellBoxes            = num_cells;
+  sizes.points               = num_points;
+  sizes.cellVectors          = num_cells;
+  sizes.cellPoints           = (flags & STADIUM_FLAG_HEX8) ? 8 * num_cells : 9 * num_cells;
+  sizes.cellPointsBegIndices = (flags & STADIUM_FLAG_HEX8) ? 0 : num_cells;
+  sizes.pointVectors         = num_points;
+  sizes.cellVolumes          = num_cells;
 
-    // setting the point vectors
-    pointVectors.resize(points.size());
-    for (auto& point_vector : pointVectors)
-      point_vector = float3(0.0f, 0.0f, 1.0f);
+  sizes.header_bytes = stadium_header_bytes(sizes);
 
-    // setting the cell boxes
-    cellBoxes.resize(cellPointsBegIndices.size());
-    for (size_t begIdx = 0; begIdx < cellPointsBegIndices.size(); begIdx++){
+  size_t template_bytes = sizeof(uint32_t) * ((flags & STADIUM_FLAG_HEX8) ? 8 : 9) * sizes.template_cells;
 
-      uint32_t num_points = cellPoints[cellPointsBegIndices[begIdx] + 0];
-      for (uint32_t i = 1; i <= num_points; i++)
-        cellBoxes[begIdx].extend(points[cellPoints[cellPointsBegIndices[begIdx] + i]]);
+  sizes.output_bytes = sizes.header_bytes + sizes.array_bytes();
+  sizes.peak_bytes   = sizes.array_bytes() + sizeof(StadiumBlock) * sizes.num_blocks + template_bytes;
 
+  // the streaming writer keeps the block list, the cell templates and one block worth of points,
+  // boxes and connectivity
+  sizes.stream_peak_bytes = sizeof(StadiumBlock) * sizes.num_blocks
+                          + template_bytes
+                          + sizeof(float3)   * sizes.max_block_points
+                          + sizeof(AABB)     * sizes.max_block_cells
+                          + sizeof(float)    * sizes.max_block_cells
+                          + stadium_index_bytes(flags) * 10 * sizes.max_block_cells
+                          + stadium_stream_buffer_bytes;
+}
+
+// Byte offsets of the sections of a .stadium file.
+struct StadiumLayout {
+  size_t cellBoxes;
+  size_t points;
+  size_t cellVectors;
+  size_t cellPoints;
+  size_t cellPointsBegIndices;
+  size_t pointVectors;
+  size_t cellVolumes;
+  size_t end;
+};
+
+void compute_stadium_layout(const StadiumSizes& sizes, StadiumLayout& layout){
+  layout.cellBoxes            = sizes.header_bytes;
+  layout.points               = layout.cellBoxes            + sizeof(AABB)     * sizes.cellBoxes;
+  layout.cellVectors          = layout.points               + sizeof(float3)   * sizes.points;
+  layout.cellPoints           = layout.cellVectors          + sizeof(float3)   * sizes.cellVectors;
+  layout.cellPointsBegIndices = layout.cellPoints           + stadium_index_bytes(sizes.flags) * sizes.cellPoints;
+  layout.pointVectors         = layout.cellPointsBegIndices + stadium_index_bytes(sizes.flags) * sizes.cellPointsBegIndices;
+  layout.cellVolumes          = layout.pointVectors         + sizeof(float3)   * sizes.pointVectors;
+  layout.end                  = layout.cellVolumes          + sizeof(float)    * sizes.cellVolumes;
+}
+
+enum StadiumOutputMode {
+  STADIUM_OUTPUT_MEMORY,      // generate all arrays in memory, then write them
+  STADIUM_OUTPUT_STREAM,      // write every section block by block through bounded buffers
+  STADIUM_OUTPUT_MAPPED       // size the file up front and generate every block into the mapped file
+};
+
+struct StadiumWriteOptions {
+  unsigned          num_threads;    // worker threads used for the generation, 0 uses all hardware threads
+  StadiumOutputMode mode;
+  uint32_t          flags;          // StadiumFileFlags of the output
+
+  StadiumWriteOptions(){
+    num_threads = 0;
+    mode        = STADIUM_OUTPUT_MEMORY;
+    flags       = 0;
+  }
+};
+
+// Single traversal of the layers, blocks and lattices of a stadium, specialized at compile time on
+// a sink policy. A sink provides
+//
+//   static const bool visits_points;   // whether point() is called for every lattice point
+//   static const bool parallel;        // whether the blocks may be handed out concurrently
+//   void begin(const StadiumSizes& sizes, const std::vector<StadiumBlock>& blocks);
+//   void point(size_t index, const float3& p);       // global point index
+//   void block(const StadiumBlock& block);           // after the points of the block
+//
+// A parallel sink gets the blocks on num_threads workers and writes to the disjoint ranges given by
+// first_point and first_cell, sized once in begin(). The sinks of the generator are
+// StadiumArraySink and StadiumCountSink; the visualizer has its own for the GPU line buffers.
+template <typename Sink>
+void traverse_stadium_blocks(const std::vector<StadiumBlock>& blocks, Sink& sink, unsigned num_threads = 0){
+  parallel_for(0, blocks.size(), Sink::parallel ? num_threads : 1, [&](size_t b){
+    const StadiumBlock& block = blocks[b];
+
+    if constexpr (Sink::visits_points){
+      size_t first_point = block.first_point;
+      for_each_block_point(block, [&sink, first_point](size_t k, const float3& p){
+        sink.point(first_point + k, p);
+      });
     }
 
+    sink.block(block);
+  });
+}
+
+template <typename Sink>
+void traverse_stadium(const Stadium& stadium, Sink& sink, uint32_t flags = 0, unsigned num_threads = 0){
+  StadiumSizes sizes;
+  compute_stadium_sizes(stadium, sizes, flags);
+
+  std::vector<StadiumBlock> blocks;
+  blocks.reserve(sizes.num_blocks);
+  compute_stadium_blocks(stadium, blocks);
+
+  sink.begin(sizes, blocks);
+  traverse_stadium_blocks(blocks, sink, num_threads);
+}
+
+// Sink writing the seven .stadium arrays through raw pointers, into vectors or a mapped file alike.
+// Index is the connectivity entry type, uint64_t for STADIUM_FLAG_INDEX64. The vector pointers may
+// be null when the constant sections are written elsewhere.
+template <typename Index>
+struct StadiumArraySink {
+  static const bool visits_points = true;
+  static const bool parallel      = true;
+
+  const StadiumCellTemplates* templates;
+  float3*                     points;
+  float3*                     pointVectors;
+  Index*                      cellPoints;
+  Index*                      cellPointsBegIndices;     // null in the hex layout
+  AABB*                       cellBoxes;
+  float3*                     cellVectors;
+  float*                      cellVolumes;
+
+  StadiumArraySink(){
+    templates   = 0;
+    points      = pointVectors = cellVectors = 0;
+    cellPoints  = cellPointsBegIndices = 0;
+    cellBoxes   = 0;
+    cellVolumes = 0;
+  }
+
+  void begin(const StadiumSizes&, const std::vector<StadiumBlock>&){}
+
+  void point(size_t index, const float3& p){
+    points[index] = p;
+    if (pointVectors)
+      pointVectors[index] = float3(0.0f, 0.0f, 1.0f);
+  }
+
+  void block(const StadiumBlock& block){
+    size_t stride = (templates->flags & STADIUM_FLAG_HEX8) ? 8 : 9;
+    emit_block_cells(block, *templates, cellPoints + stride * block.first_cell,
+                     cellPointsBegIndices ? cellPointsBegIndices + block.first_cell : 0);
+
+    generate_block_boxes_volumes(block, cellBoxes + block.first_cell, cellVolumes + block.first_cell);
+
+    if (cellVectors)
+      std::fill(cellVectors + block.first_cell, cellVectors + block.first_cell + block.num_cells(), float3(0.0f, 0.0f, 1.0f));
+  }
+};
+
+// Sink counting the blocks, points and cells of every layer without generating anything.
+struct StadiumCountSink {
+  static const bool visits_points = false;
+  static const bool parallel      = false;
+
+  std::vector<size_t> layer_blocks;
+  std::vector<size_t> layer_points;
+  std::vector<size_t> layer_cells;
+
+  void begin(const StadiumSizes&, const std::vector<StadiumBlock>& blocks){
+    size_t num_layers = blocks.empty() ? 0 : static_cast<size_t>(blocks.back().layer) + 1;
+    layer_blocks.assign(num_layers, 0);
+    layer_points.assign(num_layers, 0);
+    layer_cells.assign(num_layers, 0);
+  }
+
+  void point(size_t, const float3&){}
+
+  void block(const StadiumBlock& block){
+    layer_blocks[block.layer]++;
+    layer_points[block.layer] += block.num_points();
+    layer_cells[block.layer]  += block.num_cells();
+  }
+};
+
+// Generates the whole stadium into arrays. All seven arrays are sized exactly by the counting pass
+// and the block offsets are known before anything is generated, so every block is filled
+// concurrently.
+void generate_stadium(const Stadium& stadium, StadiumArrays& arrays, const StadiumWriteOptions& options = StadiumWriteOptions()){
+  StadiumSizes sizes;
+  compute_stadium_sizes(stadium, sizes, options.flags);
+
+  std::vector<StadiumBlock> blocks;
+  blocks.reserve(sizes.num_blocks);
+  compute_stadium_blocks(stadium, blocks);
+
+  arrays.flags = options.flags;
+  arrays.points.resize(sizes.points);
+  arrays.cellPoints.resize(sizes.cellPoints);
+  arrays.cellPointsBegIndices.resize(sizes.cellPointsBegIndices);
+  arrays.cellBoxes.resize(sizes.cellBoxes);
+
+  arrays.cellVolumes.resize(sizes.cellVolumes);
+
+  // the cell and point vectors are constant
+  arrays.cellVectors.assign(sizes.cellVectors, float3(0.0f, 0.0f, 1.0f));
+  arrays.pointVectors.assign(sizes.pointVectors, float3(0.0f, 0.0f, 1.0f));
+
+  StadiumCellTemplates templates;
+  build_stadium_cell_templates(stadium, options.flags, templates, options.num_threads);
+
+  StadiumArraySink<uint32_t> sink;
+  sink.templates            = &templates;
+  sink.points               = arrays.points.data();
+  sink.cellPoints           = arrays.cellPoints.data();
+  sink.cellPointsBegIndices = arrays.cellPointsBegIndices.empty() ? 0 : arrays.cellPointsBegIndices.data();
+  sink.cellBoxes            = arrays.cellBoxes.data();
+  sink.cellVolumes          = arrays.cellVolumes.data();
+
+  traverse_stadium_blocks(blocks, sink, options.num_threads);
+}
+
+// Writes the text count header of a .stadium file, the first count with the leading zeros of
+// stadium_header_padding().
+void write_stadium_header(std::ostream& out, const StadiumSizes& sizes){
+  if (sizes.flags)
+    out << "STADIUM " << sizes.flags << std::endl;
+  out << std::string(stadium_header_padding(sizes), '0') << sizes.cellBoxes << std::endl;
+  out << sizes.points << std::endl;
+  out << sizes.cellVectors << std::endl;
+  out << sizes.cellPoints << std::endl;
+  out << sizes.cellPointsBegIndices << std::endl;
+  out << sizes.pointVectors << std::endl;
+  out << sizes.cellVolumes << std::endl;
+}
+
+bool save_stadium(const std::string& filename, const StadiumArrays& arrays){
+
+  std::ofstream out(filename.c_str(), std::ios_base::binary);
+
+  if (out)
+  {
     std::cout << "saveBinary: saving " << filename << std::endl;
 
-    size_t cellBoxesNumber            = cellBoxes.size();
-    size_t pointsNumber               = points.size();
-    size_t cellPointsNumber           = cellPoints.size();
-    size_t cellPointsBegIndicesNumber = cellPointsBegIndices.size();
-    size_t cellVectorsNumber          = cellVectors.size();
-    size_t pointVectorsNumber         = pointVectors.size();
-    size_t cellVolumesNumber          = cellVolumes.size();
+    StadiumSizes sizes;
+    sizes.flags                = arrays.flags;
+    sizes.cellBoxes            = arrays.cellBoxes.size();
+    sizes.points               = arrays.points.size();
+    sizes.cellPoints           = arrays.cellPoints.size();
+    sizes.cellPointsBegIndices = arrays.cellPointsBegIndices.size();
+    sizes.cellVectors          = arrays.cellVectors.size();
+    sizes.pointVectors         = arrays.pointVectors.size();
+    sizes.cellVolumes          = arrays.cellVolumes.size();
+
+    write_stadium_header(out, sizes);
+
+    out.write((const char*)(arrays.cellBoxes.data()),             sizeof(AABB)*sizes.cellBoxes);
+    out.write((const char*)(arrays.points.data()),                sizeof(float3)*sizes.points);
+    out.write((const char*)(arrays.cellVectors.data()),           sizeof(float3)*sizes.cellVectors);
+    out.write((const char*)(arrays.cellPoints.data()),            sizeof(uint32_t)*sizes.cellPoints);
+    out.write((const char*)(arrays.cellPointsBegIndices.data()),  sizeof(uint32_t)*sizes.cellPointsBegIndices);
+    out.write((const char*)(arrays.pointVectors.data()),          sizeof(float3)*sizes.pointVectors);
+    out.write((const char*)(arrays.cellVolumes.data()),           sizeof(float)*sizes.cellVolumes);
+  }
+
+  return !!out;
+
+}
 
+// Writes count copies of value through a buffer of stadium_stream_buffer_bytes.
+template <typename T>
+void write_stadium_constant_section(std::ostream& out, const T& value, size_t count){
+  std::vector<T> buffer(std::min(count, stadium_stream_buffer_bytes / sizeof(T)), value);
+  while (count > 0 && out){
+    size_t n = std::min(count, buffer.size());
+    out.write((const char*)(buffer.data()), sizeof(T)*n);
+    count -= n;
+  }
+}
 
-    out << cellBoxesNumber << std::endl;
-    out << pointsNumber << std::endl;
-    out << cellVectorsNumber << std::endl;
-    out << cellPointsNumber << std::endl;
-    out << cellPointsBegIndicesNumber << std::endl;
-    out << pointVectorsNumber << std::endl;
-    out << cellVolumesNumber << std::endl;
+// Writes the connectivity sections of the blocks through a block-sized buffer of Index entries.
+template <typename Index>
+void write_stadium_stream_cells(std::ostream& out, const std::vector<StadiumBlock>& blocks, const StadiumCellTemplates& templates,
+                                size_t max_block_cells){
+  bool hex = (templates.flags & STADIUM_FLAG_HEX8) != 0;
 
+  std::vector<Index> cellPoints((hex ? 8 : 9) * max_block_cells);
+  std::vector<Index> cellPointsBegIndices(hex ? 0 : max_block_cells);
 
-    out.write((char*)(&cellBoxes[0]),             sizeof(AABB)*cellBoxesNumber);
-    out.write((char*)(&points[0]),                sizeof(float3)*pointsNumber);
-    out.write((char*)(&cellVectors[0]),           sizeof(float3)*cellVectorsNumber);
-    out.write((char*)(&cellPoints[0]),            sizeof(uint32_t)*cellPointsNumber);
-    out.write((char*)(&cellPointsBegIndices[0]),  sizeof(uint32_t)*cellPointsBegIndicesNumber);
-    out.write((char*)(&pointVectors[0]),          sizeof(float3)*pointVectorsNumber);
-    out.write((char*)(&cellVolumes[0]),           sizeof(float)*cellVolumesNumber);
+  for (size_t b = 0; b < blocks.size() && out; b++){
+    emit_block_cells(blocks[b], templates, cellPoints.data(), (Index*)0);
+    out.write((const char*)(cellPoints.data()), sizeof(Index)*(hex ? 8 : 9)*blocks[b].num_cells());
+  }
+
+  for (size_t b = 0; b < blocks.size() && out && !hex; b++){
+    emit_block_cells(blocks[b], templates, (Index*)0, cellPointsBegIndices.data());
+    out.write((const char*)(cellPointsBegIndices.data()), sizeof(Index)*blocks[b].num_cells());
+  }
+}
+
+// Writes the stadium section by section to out. Every section is a pass over the blocks that
+// regenerates the data of one block at a time, so the memory used depends on the largest block and
+// not on the size of the stadium.
+bool write_stadium_stream(std::ostream& out, const Stadium& stadium, const StadiumWriteOptions& options = StadiumWriteOptions()){
+  StadiumSizes sizes;
+  compute_stadium_sizes(stadium, sizes, options.flags);
+
+  std::vector<StadiumBlock> blocks;
+  blocks.reserve(sizes.num_blocks);
+  compute_stadium_blocks(stadium, blocks);
+
+  std::vector<float3> points(sizes.max_block_points);
+  std::vector<AABB>   cellBoxes(sizes.max_block_cells);
+  std::vector<float>  cellVolumes(sizes.max_block_cells);
+
+  StadiumCellTemplates templates;
+  build_stadium_cell_templates(stadium, options.flags, templates, options.num_threads);
+
+  write_stadium_header(out, sizes);
+
+  for (size_t b = 0; b < blocks.size() && out; b++){
+    generate_block_boxes_volumes(blocks[b], cellBoxes.data(), 0);
+    out.write((const char*)(cellBoxes.data()), sizeof(AABB)*blocks[b].num_cells());
+  }
+
+  for (size_t b = 0; b < blocks.size() && out; b++){
+    generate_block_points(blocks[b], points.data());
+    out.write((const char*)(points.data()), sizeof(float3)*blocks[b].num_points());
+  }
+
+  write_stadium_constant_section(out, float3(0.0f, 0.0f, 1.0f), sizes.cellVectors);
+
+  if (options.flags & STADIUM_FLAG_INDEX64)
+    write_stadium_stream_cells<uint64_t>(out, blocks, templates, sizes.max_block_cells);
+  else
+    write_stadium_stream_cells<uint32_t>(out, blocks, templates, sizes.max_block_cells);
+
+  write_stadium_constant_section(out, float3(0.0f, 0.0f, 1.0f), sizes.pointVectors);
+
+  for (size_t b = 0; b < blocks.size() && out; b++){
+    generate_block_boxes_volumes(blocks[b], 0, cellVolumes.data());
+    out.write((const char*)(cellVolumes.data()), sizeof(float)*blocks[b].num_cells());
   }
 
   return !!out;
+}
+
+bool write_stadium_streaming(const std::string& filename, const Stadium& stadium, const StadiumWriteOptions& options = StadiumWriteOptions()){
+
+  std::ofstream out(filename.c_str(), std::ios_base::binary);
+
+  if (out)
+  {
+    std::cout << "saveBinary: streaming " << filename << std::endl;
+    write_stadium_stream(out, stadium, options);
+  }
+
+  return !!out;
+
+}
+
+// StadiumArraySink over the sections of a whole .stadium file in memory.
+template <typename Index>
+StadiumArraySink<Index> stadium_file_sink(char* data, const StadiumLayout& layout, const StadiumCellTemplates& templates){
+  StadiumArraySink<Index> sink;
+  sink.templates            = &templates;
+  sink.points               = (float3*)(data + layout.points);
+  sink.pointVectors         = (float3*)(data + layout.pointVectors);
+  sink.cellPoints           = (Index*)(data + layout.cellPoints);
+  sink.cellPointsBegIndices = (templates.flags & STADIUM_FLAG_HEX8) ? 0 : (Index*)(data + layout.cellPointsBegIndices);
+  sink.cellBoxes            = (AABB*)(data + layout.cellBoxes);
+  sink.cellVectors          = (float3*)(data + layout.cellVectors);
+  sink.cellVolumes          = (float*)(data + layout.cellVolumes);
+  return sink;
+}
+
+// Writes the stadium through a memory mapping of the output file. The file layout is known from
+// the counting pass, so the file is sized once and every block writes its points, connectivity,
+// boxes, vectors and volumes straight into their final byte ranges, on all worker threads and
+// without an intermediate copy. The count header is padded so every section is aligned for its
+// element type.
+bool write_stadium_mapped(const std::string& filename, const Stadium& stadium, const StadiumWriteOptions& options = StadiumWriteOptions()){
+
+  StadiumSizes sizes;
+  compute_stadium_sizes(stadium, sizes, options.flags);
+
+  StadiumLayout layout;
+  compute_stadium_layout(sizes, layout);
+
+  MappedFile out;
+  if (!out.create(filename, layout.end)){
+    std::cout << "===> Cannot map the " << filename << " file.\n";
+    return false;
+  }
+
+  std::cout << "saveBinary: mapping " << filename << std::endl;
+
+  std::ostringstream header;
+  write_stadium_header(header, sizes);
+  std::string header_text = header.str();
+  std::copy(header_text.begin(), header_text.end(), out.data());
+
+  std::vector<StadiumBlock> blocks;
+  blocks.reserve(sizes.num_blocks);
+  compute_stadium_blocks(stadium, blocks);
+
+  StadiumCellTemplates templates;
+  build_stadium_cell_templates(stadium, options.flags, templates, options.num_threads);
+
+  if (options.flags & STADIUM_FLAG_INDEX64){
+    StadiumArraySink<uint64_t> sink = stadium_file_sink<uint64_t>(out.data(), layout, templates);
+    traverse_stadium_blocks(blocks, sink, options.num_threads);
+  }
+  else {
+    StadiumArraySink<uint32_t> sink = stadium_file_sink<uint32_t>(out.data(), layout, templates);
+    traverse_stadium_blocks(blocks, sink, options.num_threads);
+  }
+
+  return out.close();
+
+}
+
+// Whether the local point indices and connectivity of every block fit in the 32-bit cell templates.
+bool stadium_block_indices_fit(const Stadium& stadium){
+  for (int t = 0; t < stadium.num_blocks; t++){
+    const int* dims = stadium.block_sizes[t].v;
+    if (static_cast<size_t>(dims[0] + 1) * (dims[1] + 1) * (dims[2] + 1) > UINT32_MAX ||
+        9 * static_cast<size_t>(dims[0]) * dims[1] * dims[2] > UINT32_MAX){
+      std::cout << "===> Block type " << t << " has too many points for 32-bit block-local indices.\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes the stadium in the given output mode. A stadium whose indices overflow 32 bits is written
+// with STADIUM_FLAG_INDEX64, and the in-memory arrays being 32-bit it then goes through the mapped
+// writer.
+bool write_stadium(const std::string& filename, const Stadium& stadium, const StadiumWriteOptions& options = StadiumWriteOptions()){
+
+  StadiumWriteOptions write_options = options;
+
+  if (!(write_options.flags & STADIUM_FLAG_INDEX64)){
+    StadiumSizes sizes;
+    compute_stadium_sizes(stadium, sizes, write_options.flags);
+    if (sizes.needs_index64()){
+      std::cout << "===> The indices overflow 32 bits, writing 64-bit indices.\n";
+      write_options.flags |= STADIUM_FLAG_INDEX64;
+    }
+  }
+
+  // the cell templates are block-local and 32-bit
+  if (!stadium_block_indices_fit(stadium))
+    return false;
+
+  if (write_options.mode == STADIUM_OUTPUT_STREAM)
+    return write_stadium_streaming(filename, stadium, write_options);
+
+  if (write_options.mode == STADIUM_OUTPUT_MAPPED || (write_options.flags & STADIUM_FLAG_INDEX64))
+    return write_stadium_mapped(filename, stadium, write_options);
+
+  StadiumArrays arrays;
+  generate_stadium(stadium, arrays, write_options);
+
+  return save_stadium(filename, arrays);
 
 }
 
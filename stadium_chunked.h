@@ -0,0 +1,387 @@
+#ifndef __STADIUM_CHUNKED_H__
+#define __STADIUM_CHUNKED_H__
+
+#include <fstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+
+// Chunked .stadium output: the bytes of the single file are split into pieces of at most
+// chunk_bytes, every piece holding whole elements of one section, and a text manifest lists them.
+// Concatenating the pieces in manifest order gives back the .stadium file.
+//
+//   <output>.manifest          the manifest
+//   <output>.header            the count header
+//   <output>.<section>.<k>     piece k of a section, e.g. test.stadium.points.3
+//
+// The manifest holds
+//
+//   STADIUM_MANIFEST 1
+//   flags <StadiumFileFlags>
+//   bytes <size of the whole .stadium file>
+//   header <file> <bytes>
+//   section <name> <element bytes> <elements> <pieces>     for each of the seven sections
+//   <file> <first element> <elements>                       for each piece of the section
+//
+// with the file names relative to the manifest.
+
+static const char* const stadium_section_names[7] = {
+  "cellBoxes", "points", "cellVectors", "cellPoints", "cellPointsBegIndices", "pointVectors", "cellVolumes"
+};
+
+// One file of a chunked stadium.
+struct StadiumChunkPiece {
+  std::string file;         // relative to the manifest
+  int         section;      // index in stadium_section_names, -1 for the header
+  size_t      offset;       // byte offset in the whole .stadium file
+  size_t      bytes;
+  size_t      first;        // first element of the section
+  size_t      count;        // elements of the section
+};
+
+// Element size and count of the seven sections, in file order.
+inline void stadium_section_sizes(const StadiumSizes& sizes, size_t element_bytes[7], size_t counts[7]){
+  size_t index_bytes = stadium_index_bytes(sizes.flags);
+  size_t bytes[7]    = { sizeof(AABB), sizeof(float3), sizeof(float3), index_bytes, index_bytes, sizeof(float3), sizeof(float) };
+  size_t elements[7] = { sizes.cellBoxes, sizes.points, sizes.cellVectors, sizes.cellPoints, sizes.cellPointsBegIndices, sizes.pointVectors, sizes.cellVolumes };
+  for (int s = 0; s < 7; s++){
+    element_bytes[s] = bytes[s];
+    counts[s]        = elements[s];
+  }
+}
+
+// Splits the file of the given sizes into pieces of at most chunk_bytes, rounded down to whole
+// elements and at least one element.
+void compute_stadium_chunks(const std::string& filename, const StadiumSizes& sizes, size_t chunk_bytes, std::vector<StadiumChunkPiece>& pieces){
+  pieces.clear();
+
+  std::string base = filename;
+  size_t      dir  = base.find_last_of("/\\");
+  if (dir != std::string::npos)
+    base = base.substr(dir + 1);
+
+  StadiumChunkPiece header;
+  header.file    = base + ".header";
+  header.section = -1;
+  header.offset  = 0;
+  header.bytes   = sizes.header_bytes;
+  header.first   = 0;
+  header.count   = 0;
+  pieces.push_back(header);
+
+  size_t element_bytes[7], counts[7];
+  stadium_section_sizes(sizes, element_bytes, counts);
+
+  size_t offset = sizes.header_bytes;
+  for (int s = 0; s < 7; s++){
+    size_t per_piece = std::max<size_t>(chunk_bytes / element_bytes[s], 1);
+    for (size_t first = 0, k = 0; first < counts[s]; first += per_piece, k++){
+      StadiumChunkPiece piece;
+      piece.file    = base + "." + stadium_section_names[s] + "." + std::to_string(k);
+      piece.section = s;
+      piece.first   = first;
+      piece.count   = std::min(per_piece, counts[s] - first);
+      piece.bytes   = piece.count * element_bytes[s];
+      piece.offset  = offset;
+      offset       += piece.bytes;
+      pieces.push_back(piece);
+    }
+  }
+}
+
+// Directory part of a path, with its trailing separator.
+inline std::string stadium_directory(const std::string& filename){
+  size_t dir = filename.find_last_of("/\\");
+  return dir == std::string::npos ? std::string() : filename.substr(0, dir + 1);
+}
+
+// Stream buffer that sends the bytes of a .stadium file to its pieces, opening each piece when
+// the previous one is full. Nothing is buffered beyond the piece files themselves.
+class StadiumChunkedBuffer : public std::streambuf {
+public:
+  StadiumChunkedBuffer(const std::string& directory, const std::vector<StadiumChunkPiece>& pieces)
+    : m_directory(directory), m_pieces(pieces){
+    m_piece   = 0;
+    m_left    = 0;
+    m_written = 0;
+    m_failed  = false;
+  }
+
+  // Closes the last piece, true when every byte reached its file.
+  bool close(){
+    if (m_file.is_open()){
+      m_file.close();
+      m_failed = m_failed || m_file.fail();
+    }
+    return !m_failed;
+  }
+
+  size_t written() const { return m_written; }
+
+protected:
+  std::streamsize xsputn(const char* data, std::streamsize n) override {
+    std::streamsize done = 0;
+    while (done < n){
+      if (m_left == 0 && !next_piece())
+        return done;
+
+      size_t count = std::min(static_cast<size_t>(n - done), m_left);
+      if (!m_file.write(data + done, count)){
+        m_failed = true;
+        return done;
+      }
+      m_left    -= count;
+      m_written += count;
+      done      += static_cast<std::streamsize>(count);
+    }
+    return done;
+  }
+
+  int_type overflow(int_type c) override {
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+      return traits_type::not_eof(c);
+    char byte = traits_type::to_char_type(c);
+    return xsputn(&byte, 1) == 1 ? c : traits_type::eof();
+  }
+
+  int sync() override {
+    return m_file.is_open() && !m_file.flush() ? -1 : 0;
+  }
+
+private:
+  bool next_piece(){
+    if (m_file.is_open()){
+      m_file.close();
+      if (m_file.fail()){
+        m_failed = true;
+        return false;
+      }
+      m_piece++;
+    }
+
+    // skips pieces without bytes
+    while (m_piece < m_pieces.size() && m_pieces[m_piece].bytes == 0)
+      m_piece++;
+    if (m_piece >= m_pieces.size()){
+      m_failed = true;
+      return false;
+    }
+
+    m_file.clear();
+    m_file.open((m_directory + m_pieces[m_piece].file).c_str(), std::ios_base::binary);
+    if (!m_file){
+      std::cout << "===> Cannot write " << m_directory + m_pieces[m_piece].file << ".\n";
+      m_failed = true;
+      return false;
+    }
+    m_left = m_pieces[m_piece].bytes;
+    return true;
+  }
+
+  std::string                           m_directory;
+  const std::vector<StadiumChunkPiece>& m_pieces;
+  std::ofstream                         m_file;
+  size_t                                m_piece;
+  size_t                                m_left;     // bytes left in the open piece
+  size_t                                m_written;
+  bool                                  m_failed;
+};
+
+// Writes the stadium as pieces of at most chunk_bytes plus <filename>.manifest. The data goes
+// through the streaming writer, so the memory used depends on the largest block. Indices that
+// overflow 32 bits switch the output to STADIUM_FLAG_INDEX64 like write_stadium.
+bool write_stadium_chunked(const std::string& filename, const Stadium& stadium, size_t chunk_bytes,
+                           const StadiumWriteOptions& options = StadiumWriteOptions()){
+  StadiumWriteOptions write_options = options;
+  write_options.flags &= ~static_cast<uint32_t>(STADIUM_FLAG_BVH);
+
+  StadiumSizes sizes;
+  compute_stadium_sizes(stadium, sizes, write_options.flags);
+  if (!(write_options.flags & STADIUM_FLAG_INDEX64) && sizes.needs_index64()){
+    std::cout << "===> The indices overflow 32 bits, writing 64-bit indices.\n";
+    write_options.flags |= STADIUM_FLAG_INDEX64;
+    compute_stadium_sizes(stadium, sizes, write_options.flags);
+  }
+
+  if (!stadium_block_indices_fit(stadium))
+    return false;
+
+  std::vector<StadiumChunkPiece> pieces;
+  compute_stadium_chunks(filename, sizes, chunk_bytes, pieces);
+
+  std::cout << "saveChunked: streaming " << filename << " into " << pieces.size() << " files" << std::endl;
+
+  std::string          directory = stadium_directory(filename);
+  StadiumChunkedBuffer buffer(directory, pieces);
+  std::ostream         out(&buffer);
+  bool streamed = write_stadium_stream(out, stadium, write_options);
+  if (!buffer.close() || !streamed || buffer.written() != sizes.output_bytes){
+    std::cout << "===> Cannot write the pieces of " << filename << ".\n";
+    return false;
+  }
+
+  std::ofstream manifest((filename + ".manifest").c_str());
+  if (!manifest){
+    std::cout << "===> Cannot write " << filename << ".manifest.\n";
+    return false;
+  }
+
+  size_t element_bytes[7], counts[7];
+  stadium_section_sizes(sizes, element_bytes, counts);
+
+  manifest << "STADIUM_MANIFEST 1\n";
+  manifest << "flags " << write_options.flags << "\n";
+  manifest << "bytes " << sizes.output_bytes << "\n";
+  manifest << "header " << pieces[0].file << " " << pieces[0].bytes << "\n";
+
+  size_t p = 1;
+  for (int s = 0; s < 7; s++){
+    size_t end = p;
+    while (end < pieces.size() && pieces[end].section == s)
+      end++;
+
+    manifest << "section " << stadium_section_names[s] << " " << element_bytes[s] << " " << counts[s] << " " << end - p << "\n";
+    for (; p < end; p++)
+      manifest << pieces[p].file << " " << pieces[p].first << " " << pieces[p].count << "\n";
+  }
+
+  return !!manifest;
+}
+
+// A chunked stadium opened through its manifest. Element ranges of any section are read from the
+// pieces holding them, so a reader loads only what it needs; assemble() rebuilds the single file.
+class StadiumManifest {
+public:
+  StadiumManifest(){
+    m_flags = 0;
+    m_bytes = 0;
+    for (int s = 0; s < 7; s++)
+      m_counts[s] = m_element_bytes[s] = 0;
+  }
+
+  bool open(const std::string& filename){
+    m_pieces.clear();
+    m_directory = stadium_directory(filename);
+
+    std::ifstream in(filename.c_str());
+    if (!in)
+      return fail("cannot open " + filename);
+
+    std::string magic, key;
+    int         version = 0;
+    if (!(in >> magic >> version) || magic != "STADIUM_MANIFEST" || version != 1)
+      return fail("not a stadium manifest");
+
+    StadiumChunkPiece header;
+    header.section = -1;
+    header.offset  = 0;
+    header.first   = header.count = 0;
+    if (!(in >> key >> m_flags) || key != "flags" || !(in >> key >> m_bytes) || key != "bytes" ||
+        !(in >> key >> header.file >> header.bytes) || key != "header")
+      return fail("malformed manifest header");
+    m_pieces.push_back(header);
+
+    size_t offset = header.bytes;
+    for (int s = 0; s < 7; s++){
+      std::string name;
+      size_t      element_bytes, count, num_pieces;
+      if (!(in >> key >> name >> element_bytes >> count >> num_pieces) || key != "section" || name != stadium_section_names[s] ||
+          element_bytes == 0)
+        return fail("malformed section line");
+
+      m_element_bytes[s] = element_bytes;
+      m_counts[s]        = count;
+
+      size_t next = 0;
+      for (size_t k = 0; k < num_pieces; k++){
+        StadiumChunkPiece piece;
+        piece.section = s;
+        if (!(in >> piece.file >> piece.first >> piece.count) || piece.first != next || piece.count > count - next)
+          return fail("malformed piece line");
+        piece.bytes  = piece.count * element_bytes;
+        piece.offset = offset;
+        offset      += piece.bytes;
+        next        += piece.count;
+        m_pieces.push_back(piece);
+      }
+      if (next != count)
+        return fail("the pieces do not cover the section " + name);
+    }
+
+    if (offset != m_bytes)
+      return fail("the pieces do not add up to the file size");
+
+    return true;
+  }
+
+  // Reads elements [first, first + count) of section s into dst.
+  bool read(int s, size_t first, size_t count, void* dst){
+    char* out = (char*)(dst);
+    for (const StadiumChunkPiece& piece : m_pieces){
+      if (piece.section != s || piece.first + piece.count <= first || count == 0)
+        continue;
+      if (piece.first > first)
+        break;
+
+      size_t n = std::min(piece.first + piece.count - first, count);
+      std::ifstream in((m_directory + piece.file).c_str(), std::ios_base::binary);
+      in.seekg(static_cast<std::streamoff>((first - piece.first) * m_element_bytes[s]));
+      if (!in.read(out, n * m_element_bytes[s]))
+        return fail("cannot read " + piece.file);
+
+      out   += n * m_element_bytes[s];
+      first += n;
+      count -= n;
+    }
+
+    return count == 0 || fail("section range out of bounds");
+  }
+
+  // Concatenates the pieces into a single .stadium file.
+  bool assemble(const std::string& filename){
+    std::ofstream out(filename.c_str(), std::ios_base::binary);
+    if (!out)
+      return fail("cannot write " + filename);
+
+    std::vector<char> buffer(stadium_stream_buffer_bytes);
+    for (const StadiumChunkPiece& piece : m_pieces){
+      std::ifstream in((m_directory + piece.file).c_str(), std::ios_base::binary);
+      size_t left = piece.bytes;
+      while (left > 0){
+        size_t n = std::min(left, buffer.size());
+        if (!in.read(buffer.data(), n) || !out.write(buffer.data(), n))
+          return fail("cannot copy " + piece.file);
+        left -= n;
+      }
+    }
+
+    return !!out || fail("cannot write " + filename);
+  }
+
+  uint32_t flags() const { return m_flags; }
+  size_t   bytes() const { return m_bytes; }
+  size_t   count(int s) const { return m_counts[s]; }
+  size_t   element_bytes(int s) const { return m_element_bytes[s]; }
+
+  const std::vector<StadiumChunkPiece>& pieces() const { return m_pieces; }
+  const std::string&                    error()  const { return m_error; }
+
+private:
+  bool fail(const std::string& message){
+    m_error = message;
+    return false;
+  }
+
+  std::string                    m_directory;
+  std::vector<StadiumChunkPiece> m_pieces;
+  uint32_t                       m_flags;
+  size_t                         m_bytes;
+  size_t                         m_counts[7];
+  size_t                         m_element_bytes[7];
+  std::string                    m_error;
+};
+
+#endif
@@ -0,0 +1,300 @@
+#ifndef __STADIUM_COMPACT_H__
+#define __STADIUM_COMPACT_H__
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+
+// Compact structured-block .stadium format. Instead of the explicit arrays the file stores one
+// descriptor per block; points, connectivity, boxes and volumes are all derived from it on demand
+// by StadiumCompact, the vectors are constant.
+//
+//   char     magic[8]          "STADBLK1"
+//   uint32_t version
+//   uint32_t num_blocks
+//   uint64_t num_points        of the expanded mesh
+//   uint64_t num_cells         of the expanded mesh
+//   float    cell_vector[3]    constant cell vector
+//   float    point_vector[3]   constant point vector
+//   StadiumBlockDescriptor     blocks[num_blocks], in generation order
+
+static const char     stadium_compact_magic[8] = { 'S', 'T', 'A', 'D', 'B', 'L', 'K', '1' };
+static const uint32_t stadium_compact_version  = 1;
+
+struct StadiumBlockDescriptor {
+  float     origin[3];      // lattice origin before scaling
+  float     extent[3];      // block extent before scaling
+  int32_t   dims[3];
+  uint32_t  block_type;
+  int32_t   layer;
+  int32_t   i, j;
+};
+
+static_assert(sizeof(StadiumBlockDescriptor) == 52, "StadiumBlockDescriptor is stored as is");
+
+struct StadiumCompactHeader {
+  char      magic[8];
+  uint32_t  version;
+  uint32_t  num_blocks;
+  uint64_t  num_points;
+  uint64_t  num_cells;
+  float     cell_vector[3];
+  float     point_vector[3];
+};
+
+static_assert(sizeof(StadiumCompactHeader) == 56, "StadiumCompactHeader is stored as is");
+
+bool write_stadium_compact(const std::string& filename, const Stadium& stadium){
+
+  std::ofstream out(filename.c_str(), std::ios_base::binary);
+
+  if (out)
+  {
+    std::cout << "saveCompact: saving " << filename << std::endl;
+
+    std::vector<StadiumBlock> blocks;
+    compute_stadium_blocks(stadium, blocks);
+
+    StadiumCompactHeader header;
+    std::memcpy(header.magic, stadium_compact_magic, sizeof(header.magic));
+    header.version    = stadium_compact_version;
+    header.num_blocks = static_cast<uint32_t>(blocks.size());
+    header.num_points = blocks.empty() ? 0 : blocks.back().first_point + blocks.back().num_points();
+    header.num_cells  = blocks.empty() ? 0 : blocks.back().first_cell + blocks.back().num_cells();
+    header.cell_vector[0]  = 0.0f; header.cell_vector[1]  = 0.0f; header.cell_vector[2]  = 1.0f;
+    header.point_vector[0] = 0.0f; header.point_vector[1] = 0.0f; header.point_vector[2] = 1.0f;
+
+    std::vector<StadiumBlockDescriptor> descriptors(blocks.size());
+    for (size_t b = 0; b < blocks.size(); b++){
+      StadiumBlockDescriptor& desc = descriptors[b];
+      for (int a = 0; a < 3; a++){
+        desc.origin[a] = blocks[b].offset[a];
+        desc.extent[a] = blocks[b].elem_dim[a];
+        desc.dims[a]   = blocks[b].dims[a];
+      }
+      desc.block_type = blocks[b].block_type;
+      desc.layer      = blocks[b].layer;
+      desc.i          = blocks[b].i;
+      desc.j          = blocks[b].j;
+    }
+
+    out.write((const char*)(&header), sizeof(header));
+    out.write((const char*)(descriptors.data()), sizeof(StadiumBlockDescriptor)*descriptors.size());
+  }
+
+  return !!out;
+
+}
+
+// A compact stadium file loaded into memory, with expanders for the explicit .stadium arrays.
+// Every expander writes exactly the slice [first, first + count) of the array generate_stadium
+// would produce in the general layout (9 entries per cell, 32-bit indices), so sub-ranges can be
+// expanded independently and in parallel. Files whose mesh overflows 32-bit indices are rejected.
+class StadiumCompact {
+public:
+  StadiumCompact(){
+    m_num_points = 0;
+    m_num_cells  = 0;
+  }
+
+  bool open(const std::string& filename){
+    m_blocks.clear();
+
+    std::ifstream in(filename.c_str(), std::ios_base::binary);
+    if (!in)
+      return fail("cannot open " + filename);
+
+    StadiumCompactHeader header;
+    if (!in.read((char*)(&header), sizeof(header)) || std::memcmp(header.magic, stadium_compact_magic, sizeof(header.magic)) != 0)
+      return fail("not a compact stadium file");
+
+    if (header.version != stadium_compact_version)
+      return fail("unsupported compact stadium version");
+
+    // the block table must fit the rest of the file before it is allocated
+    std::streamoff table_begin = in.tellg();
+    in.seekg(0, std::ios_base::end);
+    std::streamoff file_size = in.tellg();
+    in.seekg(table_begin);
+    if (!in || static_cast<uint64_t>(file_size - table_begin) < static_cast<uint64_t>(header.num_blocks) * sizeof(StadiumBlockDescriptor))
+      return fail("truncated block table");
+
+    std::vector<StadiumBlockDescriptor> descriptors(header.num_blocks);
+    if (!in.read((char*)(descriptors.data()), sizeof(StadiumBlockDescriptor)*descriptors.size()))
+      return fail("truncated block table");
+
+    size_t num_points = 0;
+    size_t num_cells  = 0;
+
+    m_blocks.resize(descriptors.size());
+    for (size_t b = 0; b < descriptors.size(); b++){
+      const StadiumBlockDescriptor& desc  = descriptors[b];
+      StadiumBlock&                 block = m_blocks[b];
+
+      // bounded before num_points() and num_cells() evaluate dims + 1 and their product
+      uint64_t block_points = 1;
+      for (int a = 0; a < 3; a++){
+        if (desc.dims[a] <= 0 || (block_points *= static_cast<uint64_t>(desc.dims[a]) + 1) > UINT32_MAX)
+          return fail("invalid block dimensions");
+      }
+
+      for (int a = 0; a < 3; a++){
+        block.offset[a]   = desc.origin[a];
+        block.elem_dim[a] = desc.extent[a];
+        block.dims[a]     = desc.dims[a];
+      }
+      block.block_type  = desc.block_type;
+      block.layer       = desc.layer;
+      block.i           = desc.i;
+      block.j           = desc.j;
+      block.first_point = num_points;
+      block.first_cell  = num_cells;
+
+      num_points += block.num_points();
+      num_cells  += block.num_cells();
+
+      // the expanders write the general layout with 32-bit indices
+      if (num_points > UINT32_MAX || 9 * num_cells > UINT32_MAX)
+        return fail("the expanded mesh needs 64-bit indices");
+    }
+
+    if (num_points != header.num_points || num_cells != header.num_cells)
+      return fail("block table does not match the point and cell counts");
+
+    m_num_points   = num_points;
+    m_num_cells    = num_cells;
+    m_cell_vector  = float3(header.cell_vector[0], header.cell_vector[1], header.cell_vector[2]);
+    m_point_vector = float3(header.point_vector[0], header.point_vector[1], header.point_vector[2]);
+
+    return true;
+  }
+
+  size_t num_points() const { return m_num_points; }
+  size_t num_cells()  const { return m_num_cells; }
+
+  const std::vector<StadiumBlock>& blocks() const { return m_blocks; }
+  const std::string&               error()  const { return m_error; }
+
+  // points[0 .. count) = points [first, first + count) of the expanded mesh
+  void expand_points(size_t first, size_t count, float3* points) const {
+    for_each_block_range(first, count, &StadiumBlock::first_point, &StadiumBlock::num_points,
+      [&](const StadiumBlock& block, size_t local, size_t n, size_t out){
+        size_t dims1 = static_cast<size_t>(block.dims[1] + 1);
+        size_t dims2 = static_cast<size_t>(block.dims[2] + 1);
+        for (size_t k = 0; k < n; k++){
+          size_t p  = local + k;
+          int    d2 = static_cast<int>(p % dims2);
+          int    d1 = static_cast<int>((p / dims2) % dims1);
+          int    d0 = static_cast<int>(p / dims2 / dims1);
+          points[out + k] = float3(block.coord(0, d0), block.coord(1, d1), block.coord(2, d2));
+        }
+      });
+  }
+
+  // Connectivity, begin indices, boxes and volumes of the cells [first, first + count). cellPoints
+  // receives 9 entries per cell. Any of the outputs may be null.
+  void expand_cells(size_t first, size_t count, uint32_t* cellPoints, uint32_t* cellPointsBegIndices, AABB* cellBoxes, float* cellVolumes = 0) const {
+    for_each_block_range(first, count, &StadiumBlock::first_cell, &StadiumBlock::num_cells,
+      [&](const StadiumBlock& block, size_t local, size_t n, size_t out){
+        const int* dims = block.dims;
+        size_t     s1   = static_cast<size_t>(dims[2] + 1);
+        size_t     s0   = static_cast<size_t>(dims[1] + 1) * s1;
+
+        for (size_t k = 0; k < n; k++){
+          size_t c  = local + k;
+          int    d2 = static_cast<int>(c % dims[2]);
+          int    d1 = static_cast<int>((c / dims[2]) % dims[1]);
+          int    d0 = static_cast<int>(c / dims[2] / dims[1]);
+
+          size_t cell = block.first_cell + c;
+
+          if (cellPoints){
+            uint32_t  p0 = static_cast<uint32_t>(block.first_point + d0 * s0 + d1 * s1 + d2);
+            uint32_t* e  = cellPoints + 9 * (out + k);
+            e[0] = 8;
+            e[1] = p0;
+            e[2] = static_cast<uint32_t>(p0 + s0);
+            e[3] = static_cast<uint32_t>(p0 + s0 + 1);
+            e[4] = p0 + 1;
+            e[5] = static_cast<uint32_t>(p0 + s1);
+            e[6] = static_cast<uint32_t>(p0 + s0 + s1);
+            e[7] = static_cast<uint32_t>(p0 + s0 + s1 + 1);
+            e[8] = static_cast<uint32_t>(p0 + s1 + 1);
+          }
+
+          if (cellPointsBegIndices)
+            cellPointsBegIndices[out + k] = static_cast<uint32_t>(9 * cell);
+
+          if (cellBoxes || cellVolumes){
+            AABB box;
+            for (int corner = 0; corner < 8; corner++)
+              box.extend(float3(block.coord(0, d0 + (corner & 1)), block.coord(1, d1 + ((corner >> 1) & 1)), block.coord(2, d2 + (corner >> 2))));
+
+            if (cellBoxes)
+              cellBoxes[out + k] = box;
+            if (cellVolumes)
+              cellVolumes[out + k] = stadium_cell_volume(box.max.v[0] - box.min.v[0], box.max.v[1] - box.min.v[1], box.max.v[2] - box.min.v[2]);
+          }
+        }
+      });
+  }
+
+  // Expands the whole mesh into the explicit arrays.
+  void expand(StadiumArrays& arrays, unsigned num_threads = 0) const {
+    arrays.points.resize(m_num_points);
+    arrays.cellPoints.resize(9 * m_num_cells);
+    arrays.cellPointsBegIndices.resize(m_num_cells);
+    arrays.cellBoxes.resize(m_num_cells);
+    arrays.cellVectors.assign(m_num_cells, m_cell_vector);
+    arrays.cellVolumes.resize(m_num_cells);
+    arrays.pointVectors.assign(m_num_points, m_point_vector);
+
+    parallel_for(0, m_blocks.size(), num_threads, [&](size_t b){
+      const StadiumBlock& block = m_blocks[b];
+      expand_points(block.first_point, block.num_points(), arrays.points.data() + block.first_point);
+      expand_cells(block.first_cell, block.num_cells(), arrays.cellPoints.data() + 9 * block.first_cell,
+                   arrays.cellPointsBegIndices.data() + block.first_cell, arrays.cellBoxes.data() + block.first_cell,
+                   arrays.cellVolumes.data() + block.first_cell);
+    });
+  }
+
+private:
+  // Splits the global range [first, first + count) along the blocks and calls
+  // fn(block, first local index, count, output offset) for every piece.
+  template <typename Fn>
+  void for_each_block_range(size_t first, size_t count, size_t StadiumBlock::*block_first, size_t (StadiumBlock::*block_count)() const, Fn fn) const {
+    auto it = std::upper_bound(m_blocks.begin(), m_blocks.end(), first, [&](size_t value, const StadiumBlock& block){
+      return value < block.*block_first;
+    });
+    size_t b   = it == m_blocks.begin() ? 0 : static_cast<size_t>(it - m_blocks.begin()) - 1;
+    size_t out = 0;
+
+    for (; b < m_blocks.size() && out < count; b++){
+      const StadiumBlock& block = m_blocks[b];
+      size_t local = first + out - block.*block_first;
+      size_t n     = std::min((block.*block_count)() - local, count - out);
+      fn(block, local, n, out);
+      out += n;
+    }
+  }
+
+  bool fail(const std::string& message){
+    m_blocks.clear();
+    m_error = message;
+    return false;
+  }
+
+  std::vector<StadiumBlock> m_blocks;
+  size_t                    m_num_points;
+  size_t                    m_num_cells;
+  float3                    m_cell_vector;
+  float3                    m_point_vector;
+  std::string               m_error;
+};
+
+#endif
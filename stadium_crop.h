@@ -0,0 +1,218 @@
+#ifndef __STADIUM_CROP_H__
+#define __STADIUM_CROP_H__
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+
+// The cells of one block that intersect a crop box: the sub-lattice [lo, hi) of cells along each
+// axis. first_point and first_cell are the compact offsets of the sub-lattice in the cropped mesh.
+struct StadiumCropBlock {
+  StadiumBlock  block;          // the whole block, its lattice planes give the coordinates
+  int           lo[3];
+  int           hi[3];
+  size_t        first_point;
+  size_t        first_cell;
+
+  size_t num_points() const {
+    return static_cast<size_t>(hi[0] - lo[0] + 1) * (hi[1] - lo[1] + 1) * (hi[2] - lo[2] + 1);
+  }
+
+  size_t num_cells() const {
+    return static_cast<size_t>(hi[0] - lo[0]) * (hi[1] - lo[1]) * (hi[2] - lo[2]);
+  }
+};
+
+// Whether cell d of the block spans over [qlo, qhi] along the axis.
+inline bool stadium_crop_cell_overlaps(const StadiumBlock& block, int axis, int d, float qlo, float qhi){
+  float c0 = block.coord(axis, d), c1 = block.coord(axis, d + 1);
+  return std::min(c0, c1) <= qhi && qlo <= std::max(c0, c1);
+}
+
+// Cells [lo, hi) of the block overlapping [qlo, qhi] (mesh coordinates) along the axis. The range is
+// found by scaling and then checked against the generated lattice planes, so it matches the cell
+// boxes exactly. Returns false when no cell overlaps.
+bool stadium_crop_range(const StadiumBlock& block, int axis, float qlo, float qhi, int& lo, int& hi){
+  int   n     = block.dims[axis];
+  float scale = block.elem_dim[axis] != 0.0f ? static_cast<float>(n) / block.elem_dim[axis] : 0.0f;
+  float t0    = (qlo / stadium_len[axis] - block.offset[axis]) * scale;
+  float t1    = (qhi / stadium_len[axis] - block.offset[axis]) * scale;
+
+  // the planes may run downwards, clamped before the conversion
+  float tmin = std::max(std::min(std::min(t0, t1), static_cast<float>(n)), 0.0f);
+  float tmax = std::max(std::min(std::max(t0, t1), static_cast<float>(n)), 0.0f);
+  lo = static_cast<int>(tmin);
+  hi = std::min(static_cast<int>(tmax) + 1, n);
+
+  while (lo > 0 && stadium_crop_cell_overlaps(block, axis, lo - 1, qlo, qhi))
+    lo--;
+  while (lo < hi && !stadium_crop_cell_overlaps(block, axis, lo, qlo, qhi))
+    lo++;
+  while (hi < n && stadium_crop_cell_overlaps(block, axis, hi, qlo, qhi))
+    hi++;
+  while (hi > lo && !stadium_crop_cell_overlaps(block, axis, hi - 1, qlo, qhi))
+    hi--;
+
+  return lo < hi;
+}
+
+// Lists the blocks of the stadium that intersect box (mesh coordinates) in generation order, with
+// their cell ranges and compact offsets. Layers whose box misses the query are skipped and the rows
+// and columns of the others are found by scaling, so the cost follows the size of the crop and
+// not the size of the stadium. Returns the number of cells of the crop.
+size_t compute_stadium_crop(const Stadium& stadium, const AABB& box, std::vector<StadiumCropBlock>& blocks){
+  blocks.clear();
+
+  size_t num_points = 0;
+  size_t num_cells  = 0;
+
+  for (int l = 0; l < stadium.num_layers; l++){
+    const AABB&             layer_box  = stadium.layer_bbox[l];
+    const StadiumLayerType& layer_type = stadium.layer_types[stadium.layers[l]];
+
+    // query in layer space, widened by the rounding of the scaling
+    float qlo[3], qhi[3];
+    bool  misses = false;
+    for (int a = 0; a < 3; a++){
+      float eps = 1.0e-6f * std::max(std::fabs(layer_box.min.v[a]), std::fabs(layer_box.max.v[a]));
+      qlo[a] = box.min.v[a] / stadium_len[a] - eps;
+      qhi[a] = box.max.v[a] / stadium_len[a] + eps;
+      misses = misses || qhi[a] < std::min(layer_box.min.v[a], layer_box.max.v[a])
+                      || qlo[a] > std::max(layer_box.min.v[a], layer_box.max.v[a]);
+    }
+    if (misses)
+      continue;
+
+    // candidate rows and columns, one more on each side for the rounding
+    int range[2][2];
+    int parts[2] = { layer_type.rows, layer_type.cols };
+    for (int a = 0; a < 2; a++){
+      float extent = layer_box.max.v[a] - layer_box.min.v[a];
+      float scale  = extent != 0.0f ? static_cast<float>(parts[a]) / extent : 0.0f;
+      float t0     = (qlo[a] - layer_box.min.v[a]) * scale;
+      float t1     = (qhi[a] - layer_box.min.v[a]) * scale;
+      float tmin   = std::max(std::min(std::min(t0, t1), static_cast<float>(parts[a])), 0.0f);
+      float tmax   = std::max(std::min(std::max(t0, t1), static_cast<float>(parts[a])), 0.0f);
+      range[a][0]  = std::max(static_cast<int>(tmin) - 1, 0);
+      range[a][1]  = std::min(static_cast<int>(tmax) + 2, parts[a]);
+    }
+
+    for (int i = range[0][0]; i < range[0][1]; i++){
+      for (int j = range[1][0]; j < range[1][1]; j++){
+        StadiumCropBlock crop;
+        init_stadium_block(stadium, l, i, j, crop.block);
+
+        bool empty = false;
+        for (int a = 0; a < 3 && !empty; a++)
+          empty = !stadium_crop_range(crop.block, a, box.min.v[a], box.max.v[a], crop.lo[a], crop.hi[a]);
+        if (empty)
+          continue;
+
+        crop.first_point = num_points;
+        crop.first_cell  = num_cells;
+
+        num_points += crop.num_points();
+        num_cells  += crop.num_cells();
+
+        blocks.push_back(crop);
+      }
+    }
+  }
+
+  return num_cells;
+}
+
+// Whether the crop of the stadium to box has more than 2^32 points or connectivity entries in the
+// layout of flags, i.e. needs STADIUM_FLAG_INDEX64 like StadiumSizes::needs_index64.
+bool stadium_crop_needs_index64(const Stadium& stadium, const AABB& box, uint32_t flags){
+  std::vector<StadiumCropBlock> blocks;
+  size_t num_cells  = compute_stadium_crop(stadium, box, blocks);
+  size_t num_points = blocks.empty() ? 0 : blocks.back().first_point + blocks.back().num_points();
+  size_t stride     = (flags & STADIUM_FLAG_HEX8) ? 8 : 9;
+  return num_points > UINT32_MAX || stride * num_cells > UINT32_MAX;
+}
+
+// Writes the points of the crop of the block to points[0 .. crop.num_points()), the same values
+// as the whole block generates.
+void generate_crop_block_points(const StadiumCropBlock& crop, float3* points){
+  size_t k = 0;
+  for (int d0 = crop.lo[0]; d0 <= crop.hi[0]; d0++)
+    for (int d1 = crop.lo[1]; d1 <= crop.hi[1]; d1++)
+      for (int d2 = crop.lo[2]; d2 <= crop.hi[2]; d2++)
+        points[k++] = float3(crop.block.coord(0, d0), crop.block.coord(1, d1), crop.block.coord(2, d2));
+}
+
+// Writes the boxes and volumes of the cells of the crop of the block in generation order.
+void generate_crop_block_boxes_volumes(const StadiumCropBlock& crop, AABB* cellBoxes, float* cellVolumes){
+  const StadiumBlock& block = crop.block;
+
+  size_t k = 0;
+  for (int d0 = crop.lo[0]; d0 < crop.hi[0]; d0++)
+    for (int d1 = crop.lo[1]; d1 < crop.hi[1]; d1++){
+      float x0 = std::min(block.coord(0, d0), block.coord(0, d0 + 1)), x1 = std::max(block.coord(0, d0), block.coord(0, d0 + 1));
+      float y0 = std::min(block.coord(1, d1), block.coord(1, d1 + 1)), y1 = std::max(block.coord(1, d1), block.coord(1, d1 + 1));
+
+      for (int d2 = crop.lo[2]; d2 < crop.hi[2]; d2++){
+        float z0 = std::min(block.coord(2, d2), block.coord(2, d2 + 1)), z1 = std::max(block.coord(2, d2), block.coord(2, d2 + 1));
+
+        cellBoxes[k]   = AABB(float3(x0, y0, z0), float3(x1, y1, z1));
+        cellVolumes[k] = stadium_cell_volume(x1 - x0, y1 - y0, z1 - z0);
+        k++;
+      }
+    }
+}
+
+// Generates only the cells of the stadium that intersect box (mesh coordinates), renumbered
+// compactly, with the points they use. The cells and points keep the values and the order they
+// have in the whole mesh. options.flags selects the connectivity layout.
+void generate_stadium_crop(const Stadium& stadium, const AABB& box, StadiumArrays& arrays, const StadiumWriteOptions& options = StadiumWriteOptions()){
+  std::vector<StadiumCropBlock> blocks;
+  size_t num_cells  = compute_stadium_crop(stadium, box, blocks);
+  size_t num_points = blocks.empty() ? 0 : blocks.back().first_point + blocks.back().num_points();
+
+  bool   hex    = (options.flags & STADIUM_FLAG_HEX8) != 0;
+  size_t stride = hex ? 8 : 9;
+
+  arrays.flags = options.flags;
+  arrays.points.resize(num_points);
+  arrays.cellPoints.resize(stride * num_cells);
+  arrays.cellPointsBegIndices.resize(hex ? 0 : num_cells);
+  arrays.cellBoxes.resize(num_cells);
+  arrays.cellVolumes.resize(num_cells);
+
+  arrays.cellVectors.assign(num_cells, float3(0.0f, 0.0f, 1.0f));
+  arrays.pointVectors.assign(num_points, float3(0.0f, 0.0f, 1.0f));
+
+  parallel_for(0, blocks.size(), options.num_threads, [&](size_t b){
+    const StadiumCropBlock& crop = blocks[b];
+
+    generate_crop_block_points(crop, arrays.points.data() + crop.first_point);
+
+    // the connectivity only depends on the lattice size and the offsets
+    StadiumBlock sub = crop.block;
+    for (int a = 0; a < 3; a++)
+      sub.dims[a] = crop.hi[a] - crop.lo[a];
+    sub.first_point = crop.first_point;
+    sub.first_cell  = crop.first_cell;
+
+    if (hex)
+      generate_block_hex_cells(sub, arrays.cellPoints.data() + 8 * crop.first_cell);
+    else
+      generate_block_cells(sub, arrays.cellPoints.data() + 9 * crop.first_cell, arrays.cellPointsBegIndices.data() + crop.first_cell);
+
+    generate_crop_block_boxes_volumes(crop, arrays.cellBoxes.data() + crop.first_cell, arrays.cellVolumes.data() + crop.first_cell);
+  });
+}
+
+// Generates the crop of the stadium to box and saves it.
+bool write_stadium_crop(const std::string& filename, const Stadium& stadium, const AABB& box, const StadiumWriteOptions& options = StadiumWriteOptions()){
+  StadiumArrays arrays;
+  generate_stadium_crop(stadium, box, arrays, options);
+  return save_stadium(filename, arrays);
+}
+
+#endif
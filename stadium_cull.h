@@ -0,0 +1,164 @@
+#ifndef __STADIUM_CULL_H__
+#define __STADIUM_CULL_H__
+
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+#include "stadium_lod.h"
+
+// Layout of the commands of glMultiDrawElementsIndirect, so the array is uploaded as is.
+struct StadiumDrawCommand {
+  uint32_t  count;
+  uint32_t  instanceCount;
+  uint32_t  firstIndex;
+  uint32_t  baseVertex;
+  uint32_t  baseInstance;
+};
+
+static_assert(sizeof(StadiumDrawCommand) == 20, "StadiumDrawCommand is uploaded as is");
+
+// The six planes a * x + b * y + c * z + d >= 0 bounding a view volume.
+struct StadiumFrustum {
+  float planes[6][4];
+};
+
+// Extracts the planes of the view volume of a column-major view-projection matrix, as OpenGL and
+// glm store it (Gribb and Hartmann): every plane is the last row plus or minus one of the others.
+void compute_stadium_frustum(const float* m, StadiumFrustum& frustum){
+  for (int k = 0; k < 6; k++){
+    int   row  = k / 2;
+    float sign = (k & 1) ? -1.0f : 1.0f;
+    for (int c = 0; c < 4; c++)
+      frustum.planes[k][c] = m[4 * c + 3] + sign * m[4 * c + row];
+  }
+}
+
+// Whether box is at least partly inside the frustum: the corner of the box furthest along the
+// normal of every plane must be on its inner side. Boxes near the edges of the volume may be kept
+// without being visible, never the other way round.
+inline bool stadium_box_in_frustum(const StadiumFrustum& frustum, const AABB& box){
+  for (int k = 0; k < 6; k++){
+    const float* plane = frustum.planes[k];
+    float        d     = plane[3];
+    for (int a = 0; a < 3; a++)
+      d += plane[a] * (plane[a] >= 0.0f ? box.max.v[a] : box.min.v[a]);
+    if (d < 0.0f)
+      return false;
+  }
+  return true;
+}
+
+// Box of every block, spanned by its outer lattice planes, i.e. the layer box split by the cell
+// spacing of the rows and the columns.
+void compute_stadium_block_boxes(const std::vector<StadiumBlock>& blocks, std::vector<AABB>& boxes, unsigned num_threads = 0){
+  boxes.resize(blocks.size());
+  parallel_for(0, blocks.size(), num_threads, [&](size_t b){
+    const StadiumBlock& block = blocks[b];
+    AABB                box;
+    for (int a = 0; a < 3; a++){
+      float c0 = block.coord(a, 0), c1 = block.coord(a, block.dims[a]);
+      box.min.v[a] = std::min(c0, c1);
+      box.max.v[a] = std::max(c0, c1);
+    }
+    boxes[b] = box;
+  }, 256);
+}
+
+// Visibility of every box against the frustum on num_threads workers.
+void cull_stadium_boxes(const StadiumFrustum& frustum, const std::vector<AABB>& boxes, std::vector<uint8_t>& visible, unsigned num_threads = 0){
+  visible.resize(boxes.size());
+  parallel_for(0, boxes.size(), num_threads, [&](size_t b){
+    visible[b] = stadium_box_in_frustum(frustum, boxes[b]) ? 1 : 0;
+  }, 256);
+}
+
+// Compacted draw commands of the visible blocks whose edges are the ranges
+// [block_first[b], block_first[b + 1]) of one index buffer, e.g. StadiumWireframe. Consecutive
+// visible blocks are contiguous in the buffer and become one command. Every chunk of blocks counts
+// the runs starting in it and then writes them at its offset, both on num_threads workers, so the
+// commands come out in block order. Returns the number of commands.
+size_t build_stadium_draw_commands(const std::vector<uint8_t>& visible, const std::vector<size_t>& block_first,
+                                   std::vector<StadiumDrawCommand>& commands, unsigned num_threads = 0){
+  const size_t grain      = 1 << 12;
+  size_t       num_blocks = visible.size();
+  size_t       num_chunks = (num_blocks + grain - 1) / grain;
+
+  auto run_starts = [&](size_t b){
+    return visible[b] && (b == 0 || !visible[b - 1]);
+  };
+
+  std::vector<size_t> chunk_first(num_chunks + 1, 0);
+  parallel_for(0, num_chunks, num_threads, [&](size_t chunk){
+    size_t runs = 0;
+    for (size_t b = chunk * grain; b < std::min(num_blocks, (chunk + 1) * grain); b++)
+      runs += run_starts(b);
+    chunk_first[chunk + 1] = runs;
+  });
+  for (size_t chunk = 0; chunk < num_chunks; chunk++)
+    chunk_first[chunk + 1] += chunk_first[chunk];
+
+  commands.resize(chunk_first[num_chunks]);
+  parallel_for(0, num_chunks, num_threads, [&](size_t chunk){
+    size_t next = chunk_first[chunk];
+    for (size_t b = chunk * grain; b < std::min(num_blocks, (chunk + 1) * grain); b++){
+      if (!run_starts(b))
+        continue;
+
+      // a run may go on into the next chunks, which only read it
+      size_t end = b + 1;
+      while (end < num_blocks && visible[end])
+        end++;
+
+      StadiumDrawCommand& command = commands[next++];
+      command.count         = static_cast<uint32_t>(block_first[end] - block_first[b]);
+      command.instanceCount = 1;
+      command.firstIndex    = static_cast<uint32_t>(block_first[b]);
+      command.baseVertex    = 0;
+      command.baseInstance  = 0;
+    }
+  });
+
+  return commands.size();
+}
+
+// Draw commands of the visible blocks at the levels chosen by select_stadium_lod, one per block in
+// block order, drawing the index template of the level against the points of the block.
+size_t build_stadium_lod_commands(const StadiumLod& lod, const std::vector<uint8_t>& visible, const std::vector<uint8_t>& block_level,
+                                  std::vector<StadiumDrawCommand>& commands, unsigned num_threads = 0){
+  const size_t grain      = 1 << 12;
+  size_t       num_blocks = visible.size();
+  size_t       num_chunks = (num_blocks + grain - 1) / grain;
+
+  std::vector<size_t> chunk_first(num_chunks + 1, 0);
+  parallel_for(0, num_chunks, num_threads, [&](size_t chunk){
+    size_t count = 0;
+    for (size_t b = chunk * grain; b < std::min(num_blocks, (chunk + 1) * grain); b++)
+      count += visible[b];
+    chunk_first[chunk + 1] = count;
+  });
+  for (size_t chunk = 0; chunk < num_chunks; chunk++)
+    chunk_first[chunk + 1] += chunk_first[chunk];
+
+  commands.resize(chunk_first[num_chunks]);
+  parallel_for(0, num_chunks, num_threads, [&](size_t chunk){
+    size_t next = chunk_first[chunk];
+    for (size_t b = chunk * grain; b < std::min(num_blocks, (chunk + 1) * grain); b++){
+      if (!visible[b])
+        continue;
+
+      const StadiumLodLevel& level   = lod.level(lod.blocks[b].block_type, block_level[b]);
+      StadiumDrawCommand&    command = commands[next++];
+      command.count         = static_cast<uint32_t>(level.num_indices);
+      command.instanceCount = 1;
+      command.firstIndex    = static_cast<uint32_t>(level.first_index);
+      command.baseVertex    = static_cast<uint32_t>(lod.base_point(b, block_level[b]));
+      command.baseInstance  = 0;
+    }
+  });
+
+  return commands.size();
+}
+
+#endif
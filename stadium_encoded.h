@@ -0,0 +1,503 @@
+#ifndef __STADIUM_ENCODED_H__
+#define __STADIUM_ENCODED_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+
+// Compressed encoding of the .stadium arrays. Points and connectivity are split into chunks that
+// are encoded and decoded independently, so both directions run in parallel.
+//
+// Points are quantized to a grid of step 2 * tolerance relative to the minimum of their chunk, so
+// a decoded coordinate is within tolerance of the original (plus the float rounding of the
+// result). With tolerance 0 the float bit patterns are stored instead and the encoding is
+// lossless. Each coordinate is stored as the zigzag varint of its difference to the previous
+// point of the chunk, which is a byte or two along a block lattice.
+//
+// Every connectivity entry is stored as the zigzag varint of its difference to the same entry of
+// the previous cell of the chunk, preceded by the point count in the general layout. Along a block
+// lattice every corner moves by one point from cell to cell, so a cell takes about 8 or 9 bytes
+// instead of 36. The begin indices follow from the counts. The boxes and volumes are recomputed
+// from the decoded points, the cell and point vectors must be constant.
+//
+//   char     magic[8]                            "STADENC1"
+//   uint32_t version
+//   uint32_t flags                               StadiumFileFlags of the connectivity
+//   uint64_t num_points
+//   uint64_t num_cells
+//   uint64_t num_cell_points                     entries of cellPoints
+//   float    tolerance
+//   uint32_t points_per_chunk
+//   uint32_t cells_per_chunk
+//   float    cell_vector[3]
+//   float    point_vector[3]
+//   uint32_t padding
+//   uint64_t point_chunk_offsets[num_point_chunks + 1]   relative to the end of the tables
+//   uint64_t cell_chunk_offsets[num_cell_chunks + 1]
+//   uint64_t cell_chunk_first_entry[num_cell_chunks]     first cellPoints entry of the chunk
+//   point chunks: float3 origin, then the coordinate varints
+//   cell chunks:  the connectivity varints
+
+static const char     stadium_encoded_magic[8] = { 'S', 'T', 'A', 'D', 'E', 'N', 'C', '1' };
+static const uint32_t stadium_encoded_version  = 1;
+
+struct StadiumEncodedHeader {
+  char      magic[8];
+  uint32_t  version;
+  uint32_t  flags;
+  uint64_t  num_points;
+  uint64_t  num_cells;
+  uint64_t  num_cell_points;
+  float     tolerance;
+  uint32_t  points_per_chunk;
+  uint32_t  cells_per_chunk;
+  float     cell_vector[3];
+  float     point_vector[3];
+  uint32_t  padding;
+};
+
+static_assert(sizeof(StadiumEncodedHeader) == 80, "StadiumEncodedHeader is stored as is");
+
+struct StadiumEncodeOptions {
+  float     tolerance;          // maximum error of a decoded point coordinate, 0 is lossless
+  uint32_t  points_per_chunk;
+  uint32_t  cells_per_chunk;
+  unsigned  num_threads;        // 0 uses all hardware threads
+
+  StadiumEncodeOptions(){
+    tolerance        = 0.0f;
+    points_per_chunk = 1 << 16;
+    cells_per_chunk  = 1 << 16;
+    num_threads      = 0;
+  }
+};
+
+inline void stadium_put_varint(std::vector<uint8_t>& out, uint64_t value){
+  while (value >= 0x80){
+    out.push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+inline bool stadium_get_varint(const uint8_t*& pos, const uint8_t* end, uint64_t& value){
+  value = 0;
+  for (int shift = 0; shift < 64 && pos < end; shift += 7){
+    uint8_t byte = *pos++;
+    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+inline uint64_t stadium_zigzag(int64_t value){
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+// Inverse of stadium_zigzag as the two's complement bits of the difference, so the decoder
+// accumulates in unsigned arithmetic and corrupt input wraps instead of overflowing.
+inline uint64_t stadium_unzigzag(uint64_t value){
+  return (value >> 1) ^ (0 - (value & 1));
+}
+
+// Quantized value of coordinate x of a chunk with the given origin, the float bits when lossless.
+inline int64_t stadium_quantize(float x, float origin, float tolerance){
+  if (tolerance <= 0.0f){
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return bits;
+  }
+  return static_cast<int64_t>(std::llround((static_cast<double>(x) - origin) / (2.0 * tolerance)));
+}
+
+inline float stadium_dequantize(int64_t q, float origin, float tolerance){
+  if (tolerance <= 0.0f){
+    uint32_t bits = static_cast<uint32_t>(q);
+    float    x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+  }
+  return static_cast<float>(origin + static_cast<double>(q) * (2.0 * tolerance));
+}
+
+// Encodes the arrays into filename. Fails when the vectors are not constant or the begin indices
+// do not follow the connectivity contiguously, as produced by generate_stadium.
+bool write_stadium_encoded(const std::string& filename, const StadiumArrays& arrays, const StadiumEncodeOptions& options = StadiumEncodeOptions()){
+  bool   hex        = (arrays.flags & STADIUM_FLAG_HEX8) != 0;
+  size_t num_points = arrays.points.size();
+  size_t num_cells  = arrays.cellBoxes.size();
+
+  float3 cell_vector  = arrays.cellVectors.empty()  ? float3(0.0f, 0.0f, 1.0f) : arrays.cellVectors[0];
+  float3 point_vector = arrays.pointVectors.empty() ? float3(0.0f, 0.0f, 1.0f) : arrays.pointVectors[0];
+  for (const float3& v : arrays.cellVectors)
+    if (std::memcmp(&v, &cell_vector, sizeof(float3)) != 0){
+      std::cout << "===> The encoded format needs constant cell vectors.\n";
+      return false;
+    }
+  for (const float3& v : arrays.pointVectors)
+    if (std::memcmp(&v, &point_vector, sizeof(float3)) != 0){
+      std::cout << "===> The encoded format needs constant point vectors.\n";
+      return false;
+    }
+
+  size_t points_per_chunk = std::max<uint32_t>(options.points_per_chunk, 1);
+  size_t cells_per_chunk  = std::max<uint32_t>(options.cells_per_chunk, 1);
+  size_t num_point_chunks = (num_points + points_per_chunk - 1) / points_per_chunk;
+  size_t num_cell_chunks  = (num_cells + cells_per_chunk - 1) / cells_per_chunk;
+
+  // first cellPoints entry of every cell chunk, the begin indices must be the running offsets
+  std::vector<uint64_t> cell_chunk_first_entry(num_cell_chunks);
+  size_t entry = 0;
+  for (size_t c = 0; c < num_cells; c++){
+    if (c % cells_per_chunk == 0)
+      cell_chunk_first_entry[c / cells_per_chunk] = entry;
+    if (hex){
+      entry += 8;
+      continue;
+    }
+    if (arrays.cellPointsBegIndices[c] != entry || entry >= arrays.cellPoints.size()){
+      std::cout << "===> The begin indices do not follow the connectivity, cannot encode.\n";
+      return false;
+    }
+    entry += 1 + arrays.cellPoints[entry];
+  }
+  if (entry != arrays.cellPoints.size()){
+    std::cout << "===> The connectivity size does not match the cells, cannot encode.\n";
+    return false;
+  }
+
+  std::vector<std::vector<uint8_t> > point_chunks(num_point_chunks);
+  std::vector<std::vector<uint8_t> > cell_chunks(num_cell_chunks);
+  std::atomic<bool>                  in_range(true);
+
+  parallel_for(0, num_point_chunks, options.num_threads, [&](size_t chunk){
+    size_t first = chunk * points_per_chunk;
+    size_t last  = std::min(first + points_per_chunk, num_points);
+
+    float3 origin(0.0f, 0.0f, 0.0f);
+    if (options.tolerance > 0.0f){
+      AABB box;
+      for (size_t p = first; p < last; p++)
+        box.extend(arrays.points[p]);
+      origin = box.min;
+      for (int a = 0; a < 3; a++)
+        if ((static_cast<double>(box.max.v[a]) - box.min.v[a]) / (2.0 * options.tolerance) > static_cast<double>(INT64_MAX / 4))
+          in_range = false;
+    }
+
+    std::vector<uint8_t>& out = point_chunks[chunk];
+    out.resize(sizeof(float3));
+    std::memcpy(out.data(), &origin, sizeof(float3));
+
+    int64_t prev[3] = { 0, 0, 0 };
+    for (size_t p = first; p < last && in_range; p++)
+      for (int a = 0; a < 3; a++){
+        int64_t q = stadium_quantize(arrays.points[p].v[a], origin.v[a], options.tolerance);
+        stadium_put_varint(out, stadium_zigzag(q - prev[a]));
+        prev[a] = q;
+      }
+  });
+
+  if (!in_range){
+    std::cout << "===> The tolerance is too small for the point coordinates.\n";
+    return false;
+  }
+
+  parallel_for(0, num_cell_chunks, options.num_threads, [&](size_t chunk){
+    size_t first = chunk * cells_per_chunk;
+    size_t last  = std::min(first + cells_per_chunk, num_cells);
+
+    std::vector<uint8_t>& out  = cell_chunks[chunk];
+    const uint32_t*       cell = arrays.cellPoints.data() + cell_chunk_first_entry[chunk];
+
+    out.reserve(9 * (last - first));
+
+    std::vector<int64_t> prev(8, 0);
+    for (size_t c = first; c < last; c++){
+      uint32_t count = hex ? 8 : *cell++;
+      if (!hex)
+        stadium_put_varint(out, count);
+      if (prev.size() < count)
+        prev.resize(count, 0);
+      for (uint32_t k = 0; k < count; k++){
+        stadium_put_varint(out, stadium_zigzag(static_cast<int64_t>(cell[k]) - prev[k]));
+        prev[k] = cell[k];
+      }
+      cell += count;
+    }
+  });
+
+  std::ofstream out(filename.c_str(), std::ios_base::binary);
+
+  if (out)
+  {
+    std::cout << "saveEncoded: saving " << filename << std::endl;
+
+    StadiumEncodedHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, stadium_encoded_magic, sizeof(header.magic));
+    header.version          = stadium_encoded_version;
+    header.flags            = arrays.flags;
+    header.num_points       = num_points;
+    header.num_cells        = num_cells;
+    header.num_cell_points  = arrays.cellPoints.size();
+    header.tolerance        = std::max(options.tolerance, 0.0f);
+    header.points_per_chunk = static_cast<uint32_t>(points_per_chunk);
+    header.cells_per_chunk  = static_cast<uint32_t>(cells_per_chunk);
+    std::memcpy(header.cell_vector, cell_vector.v, sizeof(header.cell_vector));
+    std::memcpy(header.point_vector, point_vector.v, sizeof(header.point_vector));
+
+    std::vector<uint64_t> point_chunk_offsets(num_point_chunks + 1, 0);
+    for (size_t k = 0; k < num_point_chunks; k++)
+      point_chunk_offsets[k + 1] = point_chunk_offsets[k] + point_chunks[k].size();
+
+    std::vector<uint64_t> cell_chunk_offsets(num_cell_chunks + 1, point_chunk_offsets[num_point_chunks]);
+    for (size_t k = 0; k < num_cell_chunks; k++)
+      cell_chunk_offsets[k + 1] = cell_chunk_offsets[k] + cell_chunks[k].size();
+
+    out.write((const char*)(&header), sizeof(header));
+    out.write((const char*)(point_chunk_offsets.data()), sizeof(uint64_t)*point_chunk_offsets.size());
+    out.write((const char*)(cell_chunk_offsets.data()), sizeof(uint64_t)*cell_chunk_offsets.size());
+    out.write((const char*)(cell_chunk_first_entry.data()), sizeof(uint64_t)*cell_chunk_first_entry.size());
+
+    for (const auto& chunk : point_chunks)
+      out.write((const char*)(chunk.data()), chunk.size());
+    for (const auto& chunk : cell_chunks)
+      out.write((const char*)(chunk.data()), chunk.size());
+  }
+
+  return !!out;
+}
+
+// An encoded stadium file mapped into memory. The chunk tables are read by open(), every chunk is
+// decoded on its own, so ranges of the mesh can be decoded independently and in parallel.
+class StadiumEncoded {
+public:
+  StadiumEncoded(){
+    std::memset(&m_header, 0, sizeof(m_header));
+    m_data = 0;
+  }
+
+  bool open(const std::string& filename){
+    m_point_offsets.clear();
+    m_cell_offsets.clear();
+    m_cell_first_entry.clear();
+
+    if (!m_file.open(filename))
+      return fail("cannot open " + filename);
+
+    if (m_file.size() < sizeof(m_header))
+      return fail("not an encoded stadium file");
+
+    std::memcpy(&m_header, m_file.data(), sizeof(m_header));
+    if (std::memcmp(m_header.magic, stadium_encoded_magic, sizeof(m_header.magic)) != 0)
+      return fail("not an encoded stadium file");
+
+    if (m_header.version != stadium_encoded_version)
+      return fail("unsupported encoded stadium version");
+
+    if (m_header.points_per_chunk == 0 || m_header.cells_per_chunk == 0)
+      return fail("invalid chunk size");
+
+    if (m_header.flags & ~static_cast<uint32_t>(STADIUM_FLAG_HEX8))
+      return fail("unsupported layout flags");
+
+    if (is_hex() && m_header.num_cell_points != 8 * m_header.num_cells)
+      return fail("hex layout connectivity size does not match the cell count");
+
+    size_t num_point_chunks = static_cast<size_t>((m_header.num_points + m_header.points_per_chunk - 1) / m_header.points_per_chunk);
+    size_t num_cell_chunks  = static_cast<size_t>((m_header.num_cells + m_header.cells_per_chunk - 1) / m_header.cells_per_chunk);
+    size_t table_entries    = num_point_chunks + 1 + num_cell_chunks + 1 + num_cell_chunks;
+
+    if (table_entries > (m_file.size() - sizeof(m_header)) / sizeof(uint64_t))
+      return fail("truncated chunk tables");
+
+    const char* tables = m_file.data() + sizeof(m_header);
+    m_point_offsets.resize(num_point_chunks + 1);
+    m_cell_offsets.resize(num_cell_chunks + 1);
+    m_cell_first_entry.resize(num_cell_chunks);
+    std::memcpy(m_point_offsets.data(), tables, sizeof(uint64_t)*m_point_offsets.size());
+    tables += sizeof(uint64_t)*m_point_offsets.size();
+    std::memcpy(m_cell_offsets.data(), tables, sizeof(uint64_t)*m_cell_offsets.size());
+    tables += sizeof(uint64_t)*m_cell_offsets.size();
+    std::memcpy(m_cell_first_entry.data(), tables, sizeof(uint64_t)*m_cell_first_entry.size());
+    tables += sizeof(uint64_t)*m_cell_first_entry.size();
+
+    m_data = (const uint8_t*)(tables);
+    size_t data_size = m_file.size() - (tables - m_file.data());
+
+    if (m_point_offsets[0] != 0 || m_cell_offsets[0] != m_point_offsets[num_point_chunks] || m_cell_offsets[num_cell_chunks] != data_size)
+      return fail("chunk tables do not match the file size");
+    for (size_t k = 0; k < num_point_chunks; k++)
+      if (m_point_offsets[k + 1] < m_point_offsets[k] + sizeof(float3))
+        return fail("invalid point chunk table");
+    for (size_t k = 0; k < num_cell_chunks; k++)
+      if (m_cell_offsets[k + 1] < m_cell_offsets[k] || m_cell_first_entry[k] > m_header.num_cell_points)
+        return fail("invalid cell chunk table");
+
+    return true;
+  }
+
+  bool   is_hex()           const { return (m_header.flags & STADIUM_FLAG_HEX8) != 0; }
+  size_t num_points()       const { return static_cast<size_t>(m_header.num_points); }
+  size_t num_cells()        const { return static_cast<size_t>(m_header.num_cells); }
+  size_t num_point_chunks() const { return m_point_offsets.empty() ? 0 : m_point_offsets.size() - 1; }
+  size_t num_cell_chunks()  const { return m_cell_first_entry.size(); }
+  float  tolerance()        const { return m_header.tolerance; }
+
+  const std::string& error() const { return m_error; }
+
+  // First point of a point chunk and first cell and cellPoints entry of a cell chunk.
+  size_t point_chunk_first(size_t chunk)       const { return chunk * m_header.points_per_chunk; }
+  size_t cell_chunk_first(size_t chunk)        const { return chunk * m_header.cells_per_chunk; }
+  size_t cell_chunk_first_entry(size_t chunk)  const { return static_cast<size_t>(m_cell_first_entry[chunk]); }
+
+  // Decodes the points of the chunk to points[0 .. chunk size).
+  bool decode_point_chunk(size_t chunk, float3* points) const {
+    size_t first = point_chunk_first(chunk);
+    size_t last  = std::min<size_t>(first + m_header.points_per_chunk, num_points());
+
+    const uint8_t* pos = m_data + m_point_offsets[chunk];
+    const uint8_t* end = m_data + m_point_offsets[chunk + 1];
+
+    float3 origin;
+    std::memcpy(&origin, pos, sizeof(float3));
+    pos += sizeof(float3);
+
+    uint64_t q[3] = { 0, 0, 0 };
+    for (size_t p = 0; p < last - first; p++)
+      for (int a = 0; a < 3; a++){
+        uint64_t delta;
+        if (!stadium_get_varint(pos, end, delta))
+          return false;
+        q[a] += stadium_unzigzag(delta);
+        points[p].v[a] = stadium_dequantize(static_cast<int64_t>(q[a]), origin.v[a], m_header.tolerance);
+      }
+
+    return pos == end;
+  }
+
+  // Decodes the connectivity of the chunk. cellPoints points at the first entry of the chunk,
+  // cellPointsBegIndices at the first cell and is not written in the hex layout.
+  bool decode_cell_chunk(size_t chunk, uint32_t* cellPoints, uint32_t* cellPointsBegIndices) const {
+    size_t first = cell_chunk_first(chunk);
+    size_t last  = std::min<size_t>(first + m_header.cells_per_chunk, num_cells());
+    size_t entry = cell_chunk_first_entry(chunk);
+    size_t limit = static_cast<size_t>(m_header.num_cell_points);
+
+    const uint8_t* pos = m_data + m_cell_offsets[chunk];
+    const uint8_t* end = m_data + m_cell_offsets[chunk + 1];
+
+    std::vector<uint64_t> prev(8, 0);
+    uint32_t*             cell = cellPoints;
+    for (size_t c = first; c < last; c++){
+      uint64_t count = 8;
+      if (!is_hex()){
+        if (!stadium_get_varint(pos, end, count) || count > UINT32_MAX)
+          return false;
+        if (entry + 1 + count > limit)
+          return false;
+        cellPointsBegIndices[c - first] = static_cast<uint32_t>(entry);
+        *cell++ = static_cast<uint32_t>(count);
+        entry  += 1 + count;
+      }
+      else if ((entry += 8) > limit)
+        return false;
+
+      if (prev.size() < count)
+        prev.resize(count, 0);
+      for (uint64_t k = 0; k < count; k++){
+        uint64_t delta;
+        if (!stadium_get_varint(pos, end, delta))
+          return false;
+        prev[k] += stadium_unzigzag(delta);
+        if (prev[k] >= m_header.num_points)
+          return false;
+        cell[k] = static_cast<uint32_t>(prev[k]);
+      }
+      cell += count;
+    }
+
+    return pos == end;
+  }
+
+  // Decodes the whole mesh into the explicit arrays on num_threads workers. The boxes and volumes
+  // are recomputed from the decoded points.
+  bool decode(StadiumArrays& arrays, unsigned num_threads = 0){
+    arrays.flags = m_header.flags;
+    arrays.points.resize(num_points());
+    arrays.cellPoints.resize(static_cast<size_t>(m_header.num_cell_points));
+    arrays.cellPointsBegIndices.resize(is_hex() ? 0 : num_cells());
+    arrays.cellBoxes.resize(num_cells());
+    arrays.cellVolumes.resize(num_cells());
+    arrays.cellVectors.assign(num_cells(), float3(m_header.cell_vector[0], m_header.cell_vector[1], m_header.cell_vector[2]));
+    arrays.pointVectors.assign(num_points(), float3(m_header.point_vector[0], m_header.point_vector[1], m_header.point_vector[2]));
+
+    std::atomic<bool> valid(true);
+
+    parallel_for(0, num_point_chunks(), num_threads, [&](size_t chunk){
+      if (!decode_point_chunk(chunk, arrays.points.data() + point_chunk_first(chunk)))
+        valid = false;
+    });
+
+    if (!valid)
+      return fail("corrupt point chunk");
+
+    parallel_for(0, num_cell_chunks(), num_threads, [&](size_t chunk){
+      size_t first = cell_chunk_first(chunk);
+      size_t last  = std::min<size_t>(first + m_header.cells_per_chunk, num_cells());
+
+      if (!decode_cell_chunk(chunk, arrays.cellPoints.data() + cell_chunk_first_entry(chunk),
+                             is_hex() ? 0 : arrays.cellPointsBegIndices.data() + first)){
+        valid = false;
+        return;
+      }
+
+      const uint32_t* cell = arrays.cellPoints.data() + cell_chunk_first_entry(chunk);
+      for (size_t c = first; c < last; c++){
+        uint32_t count = is_hex() ? 8 : *cell++;
+        AABB     box;
+        for (uint32_t k = 0; k < count; k++)
+          box.extend(arrays.points[cell[k]]);
+        cell += count;
+
+        arrays.cellBoxes[c]   = box;
+        arrays.cellVolumes[c] = stadium_cell_volume(box.max.v[0] - box.min.v[0], box.max.v[1] - box.min.v[1], box.max.v[2] - box.min.v[2]);
+      }
+    });
+
+    if (!valid)
+      return fail("corrupt cell chunk");
+
+    return true;
+  }
+
+private:
+  bool fail(const std::string& message){
+    m_file.close();
+    m_point_offsets.clear();
+    m_cell_offsets.clear();
+    m_cell_first_entry.clear();
+    m_data  = 0;
+    m_error = message;
+    return false;
+  }
+
+  MappedFile            m_file;
+  StadiumEncodedHeader  m_header;
+  const uint8_t*        m_data;
+  std::vector<uint64_t> m_point_offsets;
+  std::vector<uint64_t> m_cell_offsets;
+  std::vector<uint64_t> m_cell_first_entry;
+  std::string           m_error;
+};
+
+#endif
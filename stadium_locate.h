@@ -0,0 +1,273 @@
+#ifndef __STADIUM_LOCATE_H__
+#define __STADIUM_LOCATE_H__
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+
+// Cell id returned for a point outside of every layer.
+static const size_t stadium_no_cell = SIZE_MAX;
+
+// Point location over the structured layout of a stadium. A point is mapped to its layer through a
+// uniform grid of z buckets, to its block (i, j) and to its cell (d0, d1, d2) by scaling, so a query
+// costs a few comparisons whatever the size of the stadium. The points are given in the space of
+// the generated mesh, the cell ids and block order are those of generate_stadium.
+class StadiumLocator {
+public:
+  StadiumLocator(){
+    m_z0     = 0.0f;
+    m_inv_dz = 0.0f;
+  }
+
+  void build(const Stadium& stadium){
+    compute_stadium_blocks(stadium, m_blocks);
+
+    m_layers.resize(stadium.num_layers);
+    size_t first_block = 0;
+    for (int l = 0; l < stadium.num_layers; l++){
+      const StadiumLayerType& type  = stadium.layer_types[stadium.layers[l]];
+      Layer&                  layer = m_layers[l];
+
+      layer.box         = stadium.layer_bbox[l];
+      layer.bounds      = layer.box;
+
+      // widened by the rounding of the scaling, so the outer planes of the mesh are found
+      for (int a = 0; a < 3; a++){
+        float eps = 1.0e-6f * std::max(std::fabs(layer.box.min.v[a]), std::fabs(layer.box.max.v[a]));
+        layer.bounds.min.v[a] -= eps;
+        layer.bounds.max.v[a] += eps;
+      }
+
+      layer.rows        = type.rows;
+      layer.cols        = type.cols;
+      layer.first_block = first_block;
+      first_block      += static_cast<size_t>(type.rows) * type.cols;
+    }
+
+    // z buckets listing the layers overlapping them, in definition order
+    float z_min = FLT_MAX, z_max = -FLT_MAX;
+    for (const Layer& layer : m_layers){
+      z_min = std::min(z_min, layer.bounds.min.v[2]);
+      z_max = std::max(z_max, layer.bounds.max.v[2]);
+    }
+
+    size_t num_buckets = std::max<size_t>(4 * m_layers.size(), 1);
+    m_z0     = m_layers.empty() ? 0.0f : z_min;
+    m_inv_dz = m_layers.empty() || z_max <= z_min ? 0.0f : static_cast<float>(num_buckets) / (z_max - z_min);
+
+    m_bucket_begin.assign(num_buckets + 1, 0);
+    for (int pass = 0; pass < 2; pass++){
+      std::vector<uint32_t> fill(m_bucket_begin.begin(), m_bucket_begin.end() - 1);
+      for (size_t l = 0; l < m_layers.size(); l++){
+        size_t b0 = bucket(m_layers[l].bounds.min.v[2]);
+        size_t b1 = bucket(m_layers[l].bounds.max.v[2]);
+        for (size_t b = b0; b <= b1; b++){
+          if (pass == 0)
+            m_bucket_begin[b + 1]++;
+          else
+            m_bucket_layers[fill[b]++] = static_cast<uint32_t>(l);
+        }
+      }
+      if (pass == 0){
+        for (size_t b = 0; b < num_buckets; b++)
+          m_bucket_begin[b + 1] += m_bucket_begin[b];
+        m_bucket_layers.resize(m_bucket_begin[num_buckets]);
+      }
+    }
+  }
+
+  // Cell containing p, or stadium_no_cell. A point on a face shared by two layers goes to the first
+  // of them in the definition. A point only inside the rounding margin of a layer goes to its
+  // nearest cell there, unless a later layer contains it. coords, when given, receives the trilinear
+  // coordinates of p inside the cell, each in [0, 1].
+  size_t locate(const float3& p, float3* coords = 0) const {
+    if (m_layers.empty())
+      return stadium_no_cell;
+
+    size_t nearest = stadium_no_cell;
+    float3 nearest_coords;
+
+    float u[3] = { p.v[0] / stadium_len[0], p.v[1] / stadium_len[1], p.v[2] / stadium_len[2] };
+
+    size_t b = bucket(u[2]);
+    for (uint32_t k = m_bucket_begin[b]; k < m_bucket_begin[b + 1]; k++){
+      const Layer& layer = m_layers[m_bucket_layers[k]];
+      if (!stadium_box_contains_point(layer.bounds, u))
+        continue;
+
+      int i = lattice_index(u[0], layer.box.min.v[0], layer.box.max.v[0], layer.rows);
+      int j = lattice_index(u[1], layer.box.min.v[1], layer.box.max.v[1], layer.cols);
+
+      // the first plane of the generated blocks decides on the seams, as for the cells below
+      const StadiumBlock* row = m_blocks.data() + layer.first_block;
+      if (i > 0 && p.v[0] < row[static_cast<size_t>(i) * layer.cols].coord(0, 0))
+        i--;
+      else if (i + 1 < layer.rows && p.v[0] >= row[static_cast<size_t>(i + 1) * layer.cols].coord(0, 0))
+        i++;
+      if (j > 0 && p.v[1] < row[j].coord(1, 0))
+        j--;
+      else if (j + 1 < layer.cols && p.v[1] >= row[j + 1].coord(1, 0))
+        j++;
+
+      const StadiumBlock& block = row[static_cast<size_t>(i) * layer.cols + j];
+
+      int    d[3];
+      bool   inside = true;
+      float3 cell_coords;
+      for (int a = 0; a < 3; a++){
+        d[a] = lattice_index(u[a], block.offset[a], block.offset[a] + block.elem_dim[a], block.dims[a]);
+
+        // the generated planes are the reference, step over a rounding error of the scaling
+        if (d[a] > 0 && p.v[a] < block.coord(a, d[a]))
+          d[a]--;
+        else if (d[a] + 1 < block.dims[a] && p.v[a] >= block.coord(a, d[a] + 1))
+          d[a]++;
+
+        float lo = block.coord(a, d[a]), hi = block.coord(a, d[a] + 1);
+        float t  = hi != lo ? (p.v[a] - lo) / (hi - lo) : 0.0f;
+        inside  &= std::min(lo, hi) <= p.v[a] && p.v[a] <= std::max(lo, hi);
+        cell_coords.v[a] = std::min(std::max(t, 0.0f), 1.0f);
+      }
+
+      size_t cell = block.first_cell + (static_cast<size_t>(d[0]) * block.dims[1] + d[1]) * block.dims[2] + d[2];
+      if (inside){
+        if (coords)
+          *coords = cell_coords;
+        return cell;
+      }
+      if (nearest == stadium_no_cell){
+        nearest        = cell;
+        nearest_coords = cell_coords;
+      }
+    }
+
+    if (coords && nearest != stadium_no_cell)
+      *coords = nearest_coords;
+    return nearest;
+  }
+
+  // Locates count points on num_threads workers. cells receives the cell ids, coords (may be null)
+  // the trilinear coordinates. Returns the number of points inside the stadium.
+  size_t locate(const float3* points, size_t count, size_t* cells, float3* coords = 0, unsigned num_threads = 0) const {
+    const size_t        grain = 1 << 14;
+    std::vector<size_t> found((count + grain - 1) / grain, 0);
+
+    parallel_for(0, found.size(), num_threads, [&](size_t chunk){
+      for (size_t k = chunk * grain; k < std::min(count, (chunk + 1) * grain); k++){
+        cells[k] = locate(points[k], coords ? coords + k : 0);
+        found[chunk] += cells[k] != stadium_no_cell;
+      }
+    });
+
+    size_t total = 0;
+    for (size_t n : found)
+      total += n;
+    return total;
+  }
+
+  // Checks locate() against a brute-force scan for count points: a point inside the box of some
+  // block must be found, in a cell whose generated box contains it. Points outside of every block
+  // may still be given the nearest cell within the rounding margin of the layers. Returns the
+  // number of points failing the check.
+  size_t validate(const float3* points, size_t count, unsigned num_threads = 0) const {
+    std::vector<AABB> block_boxes(m_blocks.size());
+    for (size_t b = 0; b < m_blocks.size(); b++)
+      for (int c = 0; c < 2; c++)
+        block_boxes[b].extend(float3(m_blocks[b].coord(0, c * m_blocks[b].dims[0]),
+                                     m_blocks[b].coord(1, c * m_blocks[b].dims[1]),
+                                     m_blocks[b].coord(2, c * m_blocks[b].dims[2])));
+
+    auto contains = [](const AABB& box, const float3& p){
+      return box.min.v[0] <= p.v[0] && p.v[0] <= box.max.v[0] &&
+             box.min.v[1] <= p.v[1] && p.v[1] <= box.max.v[1] &&
+             box.min.v[2] <= p.v[2] && p.v[2] <= box.max.v[2];
+    };
+
+    const size_t        grain = 1 << 10;
+    std::vector<size_t> failed((count + grain - 1) / grain, 0);
+
+    parallel_for(0, failed.size(), num_threads, [&](size_t chunk){
+      for (size_t k = chunk * grain; k < std::min(count, (chunk + 1) * grain); k++){
+        const float3& p = points[k];
+
+        bool inside = false;
+        for (size_t b = 0; b < block_boxes.size() && !inside; b++)
+          inside = contains(block_boxes[b], p);
+
+        size_t cell = locate(p);
+        if (cell == stadium_no_cell){
+          failed[chunk] += inside;
+          continue;
+        }
+        if (!inside)
+          continue;
+
+        // the block holding the cell, then the box of the cell from its lattice planes
+        size_t b = std::upper_bound(m_blocks.begin(), m_blocks.end(), cell, [](size_t c, const StadiumBlock& block){
+          return c < block.first_cell;
+        }) - m_blocks.begin() - 1;
+        const StadiumBlock& block = m_blocks[b];
+
+        size_t local = cell - block.first_cell;
+        int    d[3]  = { static_cast<int>(local / (static_cast<size_t>(block.dims[1]) * block.dims[2])),
+                         static_cast<int>(local / block.dims[2] % block.dims[1]),
+                         static_cast<int>(local % block.dims[2]) };
+        AABB box;
+        for (int c = 0; c < 2; c++)
+          box.extend(float3(block.coord(0, d[0] + c), block.coord(1, d[1] + c), block.coord(2, d[2] + c)));
+
+        failed[chunk] += !contains(box, p);
+      }
+    });
+
+    size_t total = 0;
+    for (size_t n : failed)
+      total += n;
+    return total;
+  }
+
+  const std::vector<StadiumBlock>& blocks() const { return m_blocks; }
+
+private:
+  struct Layer {
+    AABB    box;            // layer box of the definition
+    AABB    bounds;         // box widened by the rounding of the scaling
+    int     rows;
+    int     cols;
+    size_t  first_block;
+  };
+
+  size_t bucket(float z) const {
+    float  t = (z - m_z0) * m_inv_dz;
+    size_t n = m_bucket_begin.size() - 1;
+    if (!(t > 0.0f))
+      return 0;
+    return std::min(static_cast<size_t>(t), n - 1);
+  }
+
+  static bool stadium_box_contains_point(const AABB& box, const float* u){
+    return box.min.v[0] <= u[0] && u[0] <= box.max.v[0] &&
+           box.min.v[1] <= u[1] && u[1] <= box.max.v[1] &&
+           box.min.v[2] <= u[2] && u[2] <= box.max.v[2];
+  }
+
+  // Interval of [lo, hi] split into n equal parts that holds x, clamped to [0, n).
+  static int lattice_index(float x, float lo, float hi, int n){
+    float t = hi != lo ? (x - lo) / (hi - lo) * static_cast<float>(n) : 0.0f;
+    if (!(t > 0.0f))
+      return 0;
+    return std::min(static_cast<int>(t), n - 1);
+  }
+
+  std::vector<StadiumBlock> m_blocks;
+  std::vector<Layer>        m_layers;
+  std::vector<uint32_t>     m_bucket_begin;   // layers of bucket b are m_bucket_layers[begin[b] .. begin[b + 1])
+  std::vector<uint32_t>     m_bucket_layers;
+  float                     m_z0;
+  float                     m_inv_dz;
+};
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef __STADIUM_LOD_H__
+#define __STADIUM_LOD_H__
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+#include "stadium_wireframe.h"
+
+// One level of the pyramid of a block type: the lattice coarsened to dims, its unique edges as
+// line indices local to the level at [first_index, first_index + num_indices) of
+// StadiumLod::indices, and its points at [first_point, first_point + num_points) of the pyramid of
+// every block of the type.
+struct StadiumLodLevel {
+  int     dims[3];
+  size_t  first_index;
+  size_t  num_indices;
+  size_t  first_point;
+  size_t  num_points;
+};
+
+// Level of detail pyramids of the blocks of a stadium. Level 0 is the full lattice, every further
+// level halves the dims (rounding up) until a single box is left. The edge indices depend only on
+// the lattice size, so they are stored once per block type and drawn against the points of a block
+// with a base vertex; the points are stored per block, all the levels of a block one after the
+// other.
+struct StadiumLod {
+  std::vector<StadiumBlock>    blocks;         // generation order, as compute_stadium_blocks
+  std::vector<StadiumLodLevel> levels;         // levels of all block types, one arena
+  std::vector<size_t>          type_levels;    // levels of block type t are [type_levels[t], type_levels[t + 1])
+  std::vector<uint32_t>        indices;
+  std::vector<float3>          points;
+  std::vector<size_t>          block_points;   // first point of the pyramid of every block, total last
+
+  int num_levels(uint32_t block_type) const {
+    return static_cast<int>(type_levels[block_type + 1] - type_levels[block_type]);
+  }
+
+  const StadiumLodLevel& level(uint32_t block_type, int k) const {
+    return levels[type_levels[block_type] + k];
+  }
+
+  // Base vertex of level k of block b.
+  size_t base_point(size_t b, int k) const {
+    return block_points[b] + level(blocks[b].block_type, k).first_point;
+  }
+};
+
+// Builds the pyramids of every block of the stadium. The index templates are generated once per
+// block type, the points of the blocks on num_threads workers. The points of all levels together
+// take about 8/7 of the full lattice for large blocks.
+void build_stadium_lod(const Stadium& stadium, StadiumLod& lod, unsigned num_threads = 0){
+  compute_stadium_blocks(stadium, lod.blocks);
+
+  // level sizes and ranges of every block type
+  lod.levels.clear();
+  lod.type_levels.assign(stadium.num_blocks + 1, 0);
+
+  size_t num_indices = 0;
+  for (int t = 0; t < stadium.num_blocks; t++){
+    lod.type_levels[t] = lod.levels.size();
+
+    StadiumLodLevel level;
+    level.first_point = 0;
+    for (int k = 0; ; k++){
+      StadiumBlock coarse = StadiumBlock();
+      for (int a = 0; a < 3; a++)
+        coarse.dims[a] = level.dims[a] = std::max(1, (stadium.block_sizes[t].v[a] + (1 << k) - 1) >> k);
+
+      level.first_index = num_indices;
+      level.num_indices = 2 * stadium_block_edge_count(coarse.dims, 0);
+      level.num_points  = coarse.num_points();
+      lod.levels.push_back(level);
+
+      num_indices       += level.num_indices;
+      level.first_point += level.num_points;
+
+      if (level.dims[0] == 1 && level.dims[1] == 1 && level.dims[2] == 1)
+        break;
+    }
+  }
+  lod.type_levels[stadium.num_blocks] = lod.levels.size();
+
+  lod.indices.resize(num_indices);
+  parallel_for(0, lod.levels.size(), num_threads, [&](size_t k){
+    const StadiumLodLevel& level  = lod.levels[k];
+    StadiumBlock           coarse = StadiumBlock();
+    for (int a = 0; a < 3; a++)
+      coarse.dims[a] = level.dims[a];
+    generate_block_edges(coarse, 0, lod.indices.data() + level.first_index);
+  });
+
+  // pyramid of points of every block
+  lod.block_points.resize(lod.blocks.size() + 1);
+  lod.block_points[0] = 0;
+  for (size_t b = 0; b < lod.blocks.size(); b++){
+    const StadiumLodLevel& last = lod.levels[lod.type_levels[lod.blocks[b].block_type + 1] - 1];
+    lod.block_points[b + 1] = lod.block_points[b] + last.first_point + last.num_points;
+  }
+
+  lod.points.resize(lod.block_points.back());
+  parallel_for(0, lod.blocks.size(), num_threads, [&](size_t b){
+    const StadiumBlock& block = lod.blocks[b];
+    for (int k = 0; k < lod.num_levels(block.block_type); k++){
+      const StadiumLodLevel& level  = lod.level(block.block_type, k);
+      StadiumBlock           coarse = block;
+      for (int a = 0; a < 3; a++)
+        coarse.dims[a] = level.dims[a];
+
+      float3* points = lod.points.data() + lod.block_points[b] + level.first_point;
+      for_each_block_point(coarse, [points](size_t q, const float3& p){
+        points[q] = p;
+      });
+    }
+  });
+}
+
+// Camera of a level selection. pixel_scale converts a size at distance 1 to pixels, e.g.
+// viewport_height / (2 * tan(fovy / 2)) for a perspective projection; max_error is the largest
+// size in pixels a cell of the chosen level may cover.
+struct StadiumLodView {
+  float3  eye;
+  float   pixel_scale;
+  float   max_error;
+
+  StadiumLodView(){
+    pixel_scale = 1.0f;
+    max_error   = 1.0f;
+  }
+};
+
+// Picks the level of every block, the coarsest one whose largest cell projects to at most
+// view.max_error pixels at the distance between the eye and the box of the block; a block around
+// the eye gets level 0. The cells of the chosen levels are never larger than the error bound on
+// screen, so the drawn edges follow the screen resolution and not the size of the mesh. Returns the
+// number of line indices of the selection.
+size_t select_stadium_lod(const StadiumLod& lod, const StadiumLodView& view, std::vector<uint8_t>& block_level, unsigned num_threads = 0){
+  block_level.resize(lod.blocks.size());
+
+  std::vector<size_t> block_indices(lod.blocks.size());
+  parallel_for(0, lod.blocks.size(), num_threads, [&](size_t b){
+    const StadiumBlock& block = lod.blocks[b];
+
+    float distance2 = 0.0f;
+    float extent[3];
+    for (int a = 0; a < 3; a++){
+      float c0 = block.coord(a, 0), c1 = block.coord(a, block.dims[a]);
+      float lo = std::min(c0, c1), hi = std::max(c0, c1);
+      float d  = std::max(std::max(lo - view.eye.v[a], view.eye.v[a] - hi), 0.0f);
+      distance2 += d * d;
+      extent[a]  = hi - lo;
+    }
+
+    // cells grow with the level, so the first level over the bound ends the search
+    float budget = view.max_error * std::sqrt(distance2) / view.pixel_scale;
+    int   chosen = 0;
+    for (int k = 1; k < lod.num_levels(block.block_type); k++){
+      const StadiumLodLevel& level = lod.level(block.block_type, k);
+      float                  cell  = std::max(std::max(extent[0] / level.dims[0], extent[1] / level.dims[1]), extent[2] / level.dims[2]);
+      if (cell > budget)
+        break;
+      chosen = k;
+    }
+
+    block_level[b]   = static_cast<uint8_t>(chosen);
+    block_indices[b] = lod.level(block.block_type, chosen).num_indices;
+  }, 64);
+
+  size_t total = 0;
+  for (size_t count : block_indices)
+    total += count;
+  return total;
+}
+
+#endif
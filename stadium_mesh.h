@@ -0,0 +1,326 @@
+#ifndef __STADIUM_MESH_H__
+#define __STADIUM_MESH_H__
+
+#include <algorithm>
+#include <string>
+#include <atomic>
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+
+#include "stadium.h"
+#include "stadium_bvh.h"
+
+// Read-only view over count elements of a memory mapped array.
+template <typename T>
+struct StadiumSpan {
+  const T* ptr;
+  size_t   count;
+
+  StadiumSpan(const T* _ptr = 0, size_t _count = 0){
+    ptr   = _ptr;
+    count = _count;
+  }
+
+  const T*  data()  const { return ptr; }
+  size_t    size()  const { return count; }
+  bool      empty() const { return count == 0; }
+  const T*  begin() const { return ptr; }
+  const T*  end()   const { return ptr + count; }
+
+  const T& operator[](size_t i) const { return ptr[i]; }
+};
+
+// A .stadium file mapped into memory. The arrays are exposed in place without being copied, so
+// opening a file costs the header parse and the size checks only. Both the general layout and the
+// fixed-stride hex layout (STADIUM_FLAG_HEX8) are read; cell_points() hides the difference. A BVH
+// section (STADIUM_FLAG_BVH) is queried in place through bvh(). Files with 64-bit indices
+// (STADIUM_FLAG_INDEX64) expose their connectivity through the *64 accessors only. The padded
+// count header of the writers aligns every section for its element type; files of other writers
+// whose sections are misaligned are copied once into aligned memory instead of being used in place.
+class StadiumMesh {
+public:
+  StadiumMesh(){
+    m_data   = 0;
+    m_size   = 0;
+    m_layout = StadiumLayout();
+    m_bvh_nodes = m_bvh_cell_indices = m_bvh_num_nodes = 0;
+  }
+
+  // Maps the file, parses the optional layout tag and the seven counts and checks that the file
+  // size matches them.
+  bool open(const std::string& filename){
+    close();
+
+    if (!m_file.open(filename))
+      return fail("cannot open " + filename);
+    m_data = m_file.data();
+    m_size = m_file.size();
+
+    size_t pos = 0;
+    if (m_size >= 8 && std::memcmp(m_data, "STADIUM ", 8) == 0){
+      size_t flags = 0;
+      pos = 8;
+      if (!parse_count(pos, flags) || flags > UINT32_MAX)
+        return fail("malformed layout tag");
+      m_sizes.flags = static_cast<uint32_t>(flags);
+    }
+
+    size_t* counts[7] = {
+      &m_sizes.cellBoxes, &m_sizes.points, &m_sizes.cellVectors, &m_sizes.cellPoints,
+      &m_sizes.cellPointsBegIndices, &m_sizes.pointVectors, &m_sizes.cellVolumes
+    };
+    for (int c = 0; c < 7; c++)
+      if (!parse_count(pos, *counts[c]) || *counts[c] > m_size)
+        return fail("malformed count header");
+
+    m_sizes.header_bytes = pos;
+    uint32_t flags       = m_sizes.flags;
+    compute_stadium_layout(m_sizes, m_layout);
+
+    if (flags & ~static_cast<uint32_t>(STADIUM_FLAG_HEX8 | STADIUM_FLAG_BVH | STADIUM_FLAG_INDEX64))
+      return fail("unsupported layout flags");
+
+    if (!sections_aligned())
+      copy_aligned();
+
+    if (has_bvh()){
+      if (!parse_bvh_section())
+        return fail("malformed BVH section");
+    }
+    else if (m_layout.end != m_size)
+      return fail("file size does not match the count header");
+
+    if (m_sizes.cellVectors != m_sizes.cellBoxes || m_sizes.cellVolumes != m_sizes.cellBoxes || m_sizes.pointVectors != m_sizes.points)
+      return fail("inconsistent per-cell or per-point array sizes");
+
+    if (is_hex()){
+      if (m_sizes.cellPointsBegIndices != 0 || m_sizes.cellPoints != 8 * m_sizes.cellBoxes)
+        return fail("hex layout connectivity size does not match the cell count");
+    }
+    else if (m_sizes.cellPointsBegIndices != m_sizes.cellBoxes)
+      return fail("inconsistent per-cell or per-point array sizes");
+
+    return true;
+  }
+
+  void close(){
+    m_file.close();
+    std::vector<uint64_t>().swap(m_copy);
+    m_data = 0;
+    m_size = 0;
+    m_sizes = StadiumSizes();
+    m_bvh_nodes = m_bvh_cell_indices = m_bvh_num_nodes = 0;
+    m_error.clear();
+  }
+
+  // Checks every cell's begin index, point count and point indices. This touches the whole
+  // connectivity, so it is kept out of open().
+  bool validate_connectivity(unsigned num_threads = 0){
+    bool valid = is_index64() ? validate_cells(cellPoints64(), cellPointsBegIndices64(), num_threads)
+                              : validate_cells(cellPoints(), cellPointsBegIndices(), num_threads);
+    if (!valid)
+      return fail("cell connectivity out of bounds");
+
+    return true;
+  }
+
+  // Pure-hex mesh in the fixed-stride layout, 8 indices per cell and no begin indices.
+  bool   is_hex()     const { return (m_sizes.flags & STADIUM_FLAG_HEX8) != 0; }
+  bool   has_bvh()    const { return (m_sizes.flags & STADIUM_FLAG_BVH) != 0; }
+  bool   is_index64() const { return (m_sizes.flags & STADIUM_FLAG_INDEX64) != 0; }
+
+  size_t num_cells()  const { return m_sizes.cellBoxes; }
+  size_t num_points() const { return m_sizes.points; }
+
+  StadiumSpan<AABB>     cellBoxes()            const { return span<AABB>(m_layout.cellBoxes, m_sizes.cellBoxes); }
+  StadiumSpan<float3>   points()               const { return span<float3>(m_layout.points, m_sizes.points); }
+  StadiumSpan<float3>   cellVectors()          const { return span<float3>(m_layout.cellVectors, m_sizes.cellVectors); }
+  StadiumSpan<uint32_t> cellPoints()           const { return is_index64() ? StadiumSpan<uint32_t>() : span<uint32_t>(m_layout.cellPoints, m_sizes.cellPoints); }
+  StadiumSpan<uint32_t> cellPointsBegIndices() const { return is_index64() ? StadiumSpan<uint32_t>() : span<uint32_t>(m_layout.cellPointsBegIndices, m_sizes.cellPointsBegIndices); }
+  StadiumSpan<float3>   pointVectors()         const { return span<float3>(m_layout.pointVectors, m_sizes.pointVectors); }
+  StadiumSpan<float>    cellVolumes()          const { return span<float>(m_layout.cellVolumes, m_sizes.cellVolumes); }
+
+  // Connectivity of a file with 64-bit indices, empty otherwise.
+  StadiumSpan<uint64_t> cellPoints64()           const { return is_index64() ? span<uint64_t>(m_layout.cellPoints, m_sizes.cellPoints) : StadiumSpan<uint64_t>(); }
+  StadiumSpan<uint64_t> cellPointsBegIndices64() const { return is_index64() ? span<uint64_t>(m_layout.cellPointsBegIndices, m_sizes.cellPointsBegIndices) : StadiumSpan<uint64_t>(); }
+
+  // Point indices of one cell, empty for a file with 64-bit indices.
+  StadiumSpan<uint32_t> cell_points(size_t cell) const {
+    if (is_index64())
+      return StadiumSpan<uint32_t>();
+    if (is_hex())
+      return StadiumSpan<uint32_t>(cellPoints().data() + 8 * cell, 8);
+
+    const uint32_t* cell_data = cellPoints().data() + cellPointsBegIndices()[cell];
+    return StadiumSpan<uint32_t>(cell_data + 1, cell_data[0]);
+  }
+
+  // Point indices of one cell of a file with 64-bit indices, empty otherwise.
+  StadiumSpan<uint64_t> cell_points64(size_t cell) const {
+    if (!is_index64())
+      return StadiumSpan<uint64_t>();
+    if (is_hex())
+      return StadiumSpan<uint64_t>(cellPoints64().data() + 8 * cell, 8);
+
+    const uint64_t* cell_data = cellPoints64().data() + cellPointsBegIndices64()[cell];
+    return StadiumSpan<uint64_t>(cell_data + 1, static_cast<size_t>(cell_data[0]));
+  }
+
+  // The BVH over the cell boxes, empty when the file has none.
+  StadiumBVHView bvh() const {
+    if (!has_bvh())
+      return StadiumBVHView();
+    return StadiumBVHView((const StadiumBVHNode*)(m_data + m_bvh_nodes), m_bvh_num_nodes,
+                          (const uint32_t*)(m_data + m_bvh_cell_indices), cellBoxes().data());
+  }
+
+  const StadiumSizes& sizes()  const { return m_sizes; }
+  const std::string&  error()  const { return m_error; }
+
+private:
+  template <typename T>
+  StadiumSpan<T> span(size_t offset, size_t count) const {
+    return StadiumSpan<T>(count > 0 ? (const T*)(m_data + offset) : 0, count);
+  }
+
+  bool aligned(size_t offset, size_t alignment) const {
+    return reinterpret_cast<uintptr_t>(m_data + offset) % alignment == 0;
+  }
+
+  // Whether every array, and the BVH behind them, can be used in place. The sections are whole
+  // multiples of 4 bytes apart, so the BVH is aligned with the cell boxes.
+  bool sections_aligned() const {
+    size_t index_align = stadium_index_bytes(m_sizes.flags);
+    return aligned(m_layout.cellBoxes, alignof(AABB)) && aligned(m_layout.points, alignof(float3)) &&
+           aligned(m_layout.cellVectors, alignof(float3)) && aligned(m_layout.cellPoints, index_align) &&
+           aligned(m_layout.cellPointsBegIndices, index_align) && aligned(m_layout.pointVectors, alignof(float3)) &&
+           aligned(m_layout.cellVolumes, alignof(float));
+  }
+
+  // Copies the file into 8-byte aligned memory, shifted so the connectivity (64-bit indices) or
+  // the cell boxes start aligned, and releases the mapping.
+  void copy_aligned(){
+    size_t anchor = is_index64() ? m_layout.cellPoints : m_layout.cellBoxes;
+    size_t align  = is_index64() ? sizeof(uint64_t) : sizeof(uint32_t);
+    size_t shift  = (align - anchor % align) % align;
+
+    m_copy.resize((shift + m_size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    std::memcpy((char*)(m_copy.data()) + shift, m_file.data(), m_size);
+    m_data = (const char*)(m_copy.data()) + shift;
+    m_file.close();
+  }
+
+  template <typename Index>
+  bool validate_cells(StadiumSpan<Index> cell_points, StadiumSpan<Index> beg_indices, unsigned num_threads) const {
+    size_t            num_points = m_sizes.points;
+    std::atomic<bool> valid(true);
+
+    if (is_hex()){
+      parallel_for(0, cell_points.size(), num_threads, [&](size_t e){
+        if (cell_points[e] >= num_points)
+          valid = false;
+      }, 1 << 18);
+
+      return valid;
+    }
+
+    parallel_for(0, beg_indices.size(), num_threads, [&](size_t c){
+      Index beg = beg_indices[c];
+      if (beg >= cell_points.size() || cell_points[beg] >= cell_points.size() - beg){
+        valid = false;
+        return;
+      }
+      for (Index i = 1; i <= cell_points[beg]; i++)
+        if (cell_points[beg + i] >= num_points)
+          valid = false;
+    }, 1 << 16);
+
+    return valid;
+  }
+
+  bool parse_count(size_t& pos, size_t& count){
+    const char* data = m_data;
+    size_t      size = m_size;
+
+    if (pos >= size || data[pos] < '0' || data[pos] > '9')
+      return false;
+
+    count = 0;
+    while (pos < size && data[pos] >= '0' && data[pos] <= '9'){
+      size_t digit = static_cast<size_t>(data[pos++] - '0');
+      if (count > (SIZE_MAX - digit) / 10)
+        return false;
+      count = count * 10 + digit;
+    }
+
+    if (pos < size && data[pos] == '\r')
+      pos++;
+    if (pos >= size || data[pos] != '\n')
+      return false;
+    pos++;
+
+    return true;
+  }
+
+  // Checks the BVH section after the arrays and the node and cell indices it holds.
+  bool parse_bvh_section(){
+    uint64_t counts[2];
+    if (m_size < m_layout.end || m_size - m_layout.end < sizeof(counts))
+      return false;
+    std::memcpy(counts, m_data + m_layout.end, sizeof(counts));
+
+    size_t available = m_size - m_layout.end - sizeof(counts);
+    if (counts[1] != m_sizes.cellBoxes || counts[0] > available / sizeof(StadiumBVHNode) ||
+        sizeof(StadiumBVHNode) * counts[0] + sizeof(uint32_t) * counts[1] != available)
+      return false;
+
+    m_bvh_num_nodes     = static_cast<size_t>(counts[0]);
+    m_bvh_nodes         = m_layout.end + sizeof(counts);
+    m_bvh_cell_indices  = m_bvh_nodes + sizeof(StadiumBVHNode) * m_bvh_num_nodes;
+
+    // children come after their parent, so one forward pass gives the longest path to every node,
+    // which bounds the traversal stack
+    const StadiumBVHNode* nodes = (const StadiumBVHNode*)(m_data + m_bvh_nodes);
+    std::vector<uint8_t>  depth(m_bvh_num_nodes, 0);
+    for (size_t n = 0; n < m_bvh_num_nodes; n++){
+      StadiumBVHNode node;
+      std::memcpy(&node, nodes + n, sizeof(node));
+      if (node.count > 0 ? static_cast<uint64_t>(node.first) + node.count > counts[1] : (node.first <= n || node.first >= m_bvh_num_nodes))
+        return false;
+      if (node.count > 0)
+        continue;
+
+      if (depth[n] + 2 >= stadium_bvh_stack_size)
+        return false;
+      depth[n + 1]      = std::max<uint8_t>(depth[n + 1], depth[n] + 1);
+      depth[node.first] = std::max<uint8_t>(depth[node.first], depth[n] + 1);
+    }
+
+    return true;
+  }
+
+  bool fail(const std::string& message){
+    m_file.close();
+    std::vector<uint64_t>().swap(m_copy);
+    m_data = 0;
+    m_size = 0;
+    m_sizes = StadiumSizes();
+    m_bvh_nodes = m_bvh_cell_indices = m_bvh_num_nodes = 0;
+    m_error = message;
+    return false;
+  }
+
+  MappedFile            m_file;
+  std::vector<uint64_t> m_copy;                // aligned copy of a file with misaligned sections
+  const char*           m_data;                // the mapping or the copy
+  size_t                m_size;
+  StadiumSizes          m_sizes;
+  StadiumLayout         m_layout;
+  size_t                m_bvh_nodes;          // byte offsets of the BVH arrays
+  size_t                m_bvh_cell_indices;
+  size_t                m_bvh_num_nodes;
+  std::string           m_error;
+};
+
+#endif
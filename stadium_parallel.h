@@ -0,0 +1,92 @@
+#ifndef __STADIUM_PARALLEL_H__
+#define __STADIUM_PARALLEL_H__
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+
+// Resolves the requested number of worker threads, 0 means one per hardware thread.
+inline unsigned stadium_num_threads(unsigned requested){
+  if (requested > 0)
+    return requested;
+
+  unsigned hw = std::thread::hardware_concurrency();
+  return hw > 0 ? hw : 1;
+}
+
+// Calls fn(k) for every k in [begin, end) on num_threads workers. The items are handed out in
+// chunks of grain through a shared counter, so items of very different cost still balance.
+template <typename Fn>
+void parallel_for(size_t begin, size_t end, unsigned num_threads, Fn fn, size_t grain = 1){
+  if (end <= begin)
+    return;
+
+  if (grain == 0)
+    grain = 1;
+
+  size_t   num_chunks = (end - begin + grain - 1) / grain;
+  unsigned workers    = static_cast<unsigned>(std::min<size_t>(stadium_num_threads(num_threads), num_chunks));
+
+  if (workers <= 1){
+    for (size_t k = begin; k < end; k++)
+      fn(k);
+    return;
+  }
+
+  std::atomic<size_t> next_chunk(0);
+  auto worker = [&](){
+    for (size_t chunk = next_chunk++; chunk < num_chunks; chunk = next_chunk++){
+      size_t chunk_beg = begin + chunk * grain;
+      size_t chunk_end = std::min(end, chunk_beg + grain);
+      for (size_t k = chunk_beg; k < chunk_end; k++)
+        fn(k);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(workers - 1);
+  for (unsigned t = 1; t < workers; t++)
+    threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads)
+    thread.join();
+}
+
+// Sorts [first, last) on num_threads workers. Chunks of the range are sorted concurrently and then
+// merged pairwise, every round of merges again in parallel.
+template <typename It, typename Less>
+void parallel_sort(It first, It last, unsigned num_threads, Less less){
+  size_t   n       = static_cast<size_t>(last - first);
+  unsigned workers = static_cast<unsigned>(std::min<size_t>(stadium_num_threads(num_threads), n / 4096 + 1));
+
+  if (workers <= 1){
+    std::sort(first, last, less);
+    return;
+  }
+
+  std::vector<size_t> bounds(workers + 1);
+  for (unsigned k = 0; k <= workers; k++)
+    bounds[k] = n * k / workers;
+
+  parallel_for(0, workers, workers, [&](size_t k){
+    std::sort(first + bounds[k], first + bounds[k + 1], less);
+  });
+
+  while (bounds.size() > 2){
+    size_t num_pairs = (bounds.size() - 1) / 2;
+    parallel_for(0, num_pairs, workers, [&](size_t k){
+      std::inplace_merge(first + bounds[2 * k], first + bounds[2 * k + 1], first + bounds[2 * k + 2], less);
+    });
+
+    std::vector<size_t> merged;
+    for (size_t k = 0; k < bounds.size(); k += 2)
+      merged.push_back(bounds[k]);
+    if (merged.back() != n)
+      merged.push_back(n);
+    bounds.swap(merged);
+  }
+}
+
+#endif
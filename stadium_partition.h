@@ -0,0 +1,503 @@
+#ifndef __STADIUM_PARTITION_H__
+#define __STADIUM_PARTITION_H__
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+#include "stadium_bvh.h"
+
+// Domain decomposition of a generated stadium. Every part is written as its own .stadium file with
+// local numbering, the owned cells first and the ghost cells after them, plus a .part file with the
+// maps back to the whole mesh:
+//
+//   char     magic[8]          "STADPRT1"
+//   uint32_t version
+//   uint32_t part
+//   uint32_t num_parts
+//   uint32_t reserved
+//   uint64_t num_owned_cells
+//   uint64_t num_ghost_cells
+//   uint64_t num_points        of the part, owned and ghost cells
+//   uint64_t num_send          owned cells that are ghosts of other parts, counted once per part
+//   uint64_t global_cells      of the whole mesh
+//   uint64_t global_points     of the whole mesh
+//   uint32_t cellGlobalIds[num_owned_cells + num_ghost_cells]
+//   uint32_t pointGlobalIds[num_points]
+//   uint32_t ghostOwners[num_ghost_cells]     part owning each ghost cell
+//   uint32_t sendCells[num_send]              local id of the owned cell
+//   uint32_t sendParts[num_send]              part that holds it as a ghost
+//
+// The ghost cells are sorted by owner and then by global id, the send lists by part and then by
+// global id, so the cells sent from p to q line up with the ghosts q receives from p. A cell is a
+// ghost of a part when it shares a point with one of its cells: without --weld the blocks share no
+// points and the halos stop at the block seams.
+
+static const char     stadium_part_magic[8] = { 'S', 'T', 'A', 'D', 'P', 'R', 'T', '1' };
+static const uint32_t stadium_part_version  = 1;
+
+struct StadiumPartHeader {
+  char      magic[8];
+  uint32_t  version;
+  uint32_t  part;
+  uint32_t  num_parts;
+  uint32_t  reserved;
+  uint64_t  num_owned_cells;
+  uint64_t  num_ghost_cells;
+  uint64_t  num_points;
+  uint64_t  num_send;
+  uint64_t  global_cells;
+  uint64_t  global_points;
+};
+
+static_assert(sizeof(StadiumPartHeader) == 72, "StadiumPartHeader is stored as is");
+
+// A (d0, d1) row of cells of a block, contiguous in generation order. The rows are the units of
+// the partition.
+struct StadiumPartRow {
+  float3    center;
+  size_t    first_cell;
+  uint32_t  count;
+};
+
+// Splits rows[begin, end) into num_parts parts starting at first_part by recursive coordinate
+// bisection: the rows are sorted along the longest axis of their centers and cut where the cell
+// counts match the share of each half.
+void stadium_bisect_rows(std::vector<StadiumPartRow>& rows, size_t begin, size_t end, uint32_t first_part, uint32_t num_parts,
+                         std::vector<uint32_t>& row_part){
+  if (num_parts <= 1 || end - begin <= 1){
+    for (size_t r = begin; r < end; r++)
+      row_part[r] = first_part;
+    return;
+  }
+
+  AABB   bounds;
+  size_t total = 0;
+  for (size_t r = begin; r < end; r++){
+    bounds.extend(rows[r].center);
+    total += rows[r].count;
+  }
+
+  int axis = 0;
+  for (int a = 1; a < 3; a++)
+    if (bounds.max.v[a] - bounds.min.v[a] > bounds.max.v[axis] - bounds.min.v[axis])
+      axis = a;
+
+  std::sort(rows.begin() + begin, rows.begin() + end, [axis](const StadiumPartRow& a, const StadiumPartRow& b){
+    return a.center.v[axis] < b.center.v[axis] || (a.center.v[axis] == b.center.v[axis] && a.first_cell < b.first_cell);
+  });
+
+  // the cut closest to the target count, at least one row on each side
+  uint32_t left_parts = num_parts / 2;
+  double   target     = static_cast<double>(total) * left_parts / num_parts;
+  size_t   cut        = begin + 1;
+  size_t   count      = rows[begin].count;
+  while (cut + 1 < end && count + 0.5 * rows[cut].count <= target)
+    count += rows[cut++].count;
+
+  stadium_bisect_rows(rows, begin, cut, first_part, left_parts, row_part);
+  stadium_bisect_rows(rows, cut, end, first_part + left_parts, num_parts - left_parts, row_part);
+}
+
+// Assigns every cell of generate_stadium to one of num_parts parts balanced by cell count. The
+// cuts follow the lattice rows of the blocks, so a part is a union of whole rows and the balance
+// is within one row. Returns false when the arrays do not follow the block layout.
+bool compute_stadium_partition(const Stadium& stadium, size_t num_cells, uint32_t num_parts, std::vector<uint32_t>& cell_part,
+                               unsigned num_threads = 0){
+  std::vector<StadiumBlock> blocks;
+  compute_stadium_blocks(stadium, blocks);
+
+  if (num_parts == 0 || num_cells != (blocks.empty() ? 0 : blocks.back().first_cell + blocks.back().num_cells())){
+    std::cout << "===> The cells do not follow the block layout, cannot partition.\n";
+    return false;
+  }
+
+  std::vector<StadiumPartRow> rows;
+  for (const StadiumBlock& block : blocks){
+    if (block.num_cells() == 0)
+      continue;
+
+    float z = 0.5f * (block.coord(2, 0) + block.coord(2, block.dims[2]));
+    for (int d0 = 0; d0 < block.dims[0]; d0++)
+      for (int d1 = 0; d1 < block.dims[1]; d1++){
+        StadiumPartRow row;
+        row.center     = float3(0.5f * (block.coord(0, d0) + block.coord(0, d0 + 1)), 0.5f * (block.coord(1, d1) + block.coord(1, d1 + 1)), z);
+        row.first_cell = block.first_cell + (static_cast<size_t>(d0) * block.dims[1] + d1) * block.dims[2];
+        row.count      = static_cast<uint32_t>(block.dims[2]);
+        rows.push_back(row);
+      }
+  }
+
+  std::vector<uint32_t> row_part(rows.size(), 0);
+  stadium_bisect_rows(rows, 0, rows.size(), 0, num_parts, row_part);
+
+  cell_part.resize(num_cells);
+  parallel_for(0, rows.size(), num_threads, [&](size_t r){
+    std::fill(cell_part.begin() + rows[r].first_cell, cell_part.begin() + rows[r].first_cell + rows[r].count, row_part[r]);
+  }, 1 << 10);
+
+  return true;
+}
+
+// The halo of a partition: every (part, cell) pair where cell belongs to another part and shares a
+// point with a cell of part. pairs is sorted by part, then by owner, then by cell.
+void compute_stadium_halo(const StadiumArrays& arrays, const std::vector<uint32_t>& cell_part,
+                          std::vector<std::pair<uint32_t, uint32_t> >& pairs, unsigned num_threads = 0){
+  const uint32_t unset  = UINT32_MAX;
+  const uint32_t shared = UINT32_MAX - 1;
+
+  bool   hex       = (arrays.flags & STADIUM_FLAG_HEX8) != 0;
+  size_t num_cells = arrays.cellBoxes.size();
+
+  auto cell_points = [&](size_t c, const uint32_t*& indices, uint32_t& count){
+    if (hex){
+      indices = arrays.cellPoints.data() + 8 * c;
+      count   = 8;
+    }
+    else {
+      indices = arrays.cellPoints.data() + arrays.cellPointsBegIndices[c] + 1;
+      count   = indices[-1];
+    }
+  };
+
+  // the part of every point, or shared with the (point, part) pairs listed in point_parts
+  std::vector<uint32_t> point_part(arrays.points.size(), unset);
+  std::vector<std::pair<uint32_t, uint32_t> > point_parts;
+  for (size_t c = 0; c < num_cells; c++){
+    const uint32_t* indices;
+    uint32_t        count;
+    cell_points(c, indices, count);
+
+    for (uint32_t k = 0; k < count; k++){
+      uint32_t& part = point_part[indices[k]];
+      if (part == unset)
+        part = cell_part[c];
+      else if (part != cell_part[c]){
+        if (part != shared){
+          point_parts.push_back(std::make_pair(indices[k], part));
+          part = shared;
+        }
+        point_parts.push_back(std::make_pair(indices[k], cell_part[c]));
+      }
+    }
+  }
+  std::sort(point_parts.begin(), point_parts.end());
+  point_parts.erase(std::unique(point_parts.begin(), point_parts.end()), point_parts.end());
+
+  // cells on a shared point are ghosts of the other parts of that point
+  const size_t grain = 1 << 16;
+  std::vector<std::vector<std::pair<uint32_t, uint32_t> > > partial((num_cells + grain - 1) / grain);
+  parallel_for(0, partial.size(), num_threads, [&](size_t chunk){
+    std::vector<uint32_t> parts;
+    for (size_t c = chunk * grain; c < std::min(num_cells, (chunk + 1) * grain); c++){
+      const uint32_t* indices;
+      uint32_t        count;
+      cell_points(c, indices, count);
+
+      parts.clear();
+      for (uint32_t k = 0; k < count; k++){
+        if (point_part[indices[k]] != shared)
+          continue;
+        auto it = std::lower_bound(point_parts.begin(), point_parts.end(), std::make_pair(indices[k], 0u));
+        for (; it != point_parts.end() && it->first == indices[k]; ++it)
+          if (it->second != cell_part[c])
+            parts.push_back(it->second);
+      }
+
+      std::sort(parts.begin(), parts.end());
+      parts.erase(std::unique(parts.begin(), parts.end()), parts.end());
+      for (uint32_t part : parts)
+        partial[chunk].push_back(std::make_pair(part, static_cast<uint32_t>(c)));
+    }
+  });
+
+  // the chunks are in cell order, so ordering by part and owner keeps the cells sorted
+  pairs.clear();
+  for (const auto& chunk : partial)
+    pairs.insert(pairs.end(), chunk.begin(), chunk.end());
+  std::stable_sort(pairs.begin(), pairs.end(), [&](const std::pair<uint32_t, uint32_t>& a, const std::pair<uint32_t, uint32_t>& b){
+    return a.first < b.first || (a.first == b.first && cell_part[a.second] < cell_part[b.second]);
+  });
+}
+
+// Copies the given cells of arrays, in order, with the points they use into part. Returns the
+// global ids of those points, sorted, part.points[k] is point global_points[k].
+void extract_stadium_cells(const StadiumArrays& arrays, const std::vector<uint32_t>& cells, StadiumArrays& part,
+                           std::vector<uint32_t>& global_points, unsigned num_threads = 0){
+  const size_t grain = 1 << 16;
+  bool         hex   = (arrays.flags & STADIUM_FLAG_HEX8) != 0;
+
+  part.flags = arrays.flags;
+  part.cellBoxes.resize(cells.size());
+  part.cellVectors.resize(cells.size());
+  part.cellVolumes.resize(cells.size());
+  part.cellPointsBegIndices.resize(hex ? 0 : cells.size());
+
+  // connectivity entries of every cell, then their offsets
+  size_t entries = 0;
+  if (hex)
+    entries = 8 * cells.size();
+  else
+    for (size_t k = 0; k < cells.size(); k++){
+      part.cellPointsBegIndices[k] = static_cast<uint32_t>(entries);
+      entries += 1 + arrays.cellPoints[arrays.cellPointsBegIndices[cells[k]]];
+    }
+  part.cellPoints.resize(entries);
+
+  parallel_for(0, cells.size(), num_threads, [&](size_t k){
+    size_t c = cells[k];
+    part.cellBoxes[k]   = arrays.cellBoxes[c];
+    part.cellVectors[k] = arrays.cellVectors[c];
+    part.cellVolumes[k] = arrays.cellVolumes[c];
+
+    if (hex)
+      std::memcpy(part.cellPoints.data() + 8 * k, arrays.cellPoints.data() + 8 * c, 8 * sizeof(uint32_t));
+    else {
+      const uint32_t* src = arrays.cellPoints.data() + arrays.cellPointsBegIndices[c];
+      std::memcpy(part.cellPoints.data() + part.cellPointsBegIndices[k], src, (1 + src[0]) * sizeof(uint32_t));
+    }
+  }, grain);
+
+  // the used points in global order, the connectivity is renumbered against them
+  global_points.resize(entries);
+  size_t num_indices = 0;
+  for (size_t k = 0; k < cells.size(); k++){
+    const uint32_t* indices = hex ? part.cellPoints.data() + 8 * k : part.cellPoints.data() + part.cellPointsBegIndices[k] + 1;
+    uint32_t        count   = hex ? 8 : indices[-1];
+    std::memcpy(global_points.data() + num_indices, indices, count * sizeof(uint32_t));
+    num_indices += count;
+  }
+  global_points.resize(num_indices);
+  parallel_sort(global_points.begin(), global_points.end(), num_threads, [](uint32_t a, uint32_t b){ return a < b; });
+  global_points.erase(std::unique(global_points.begin(), global_points.end()), global_points.end());
+
+  parallel_for(0, cells.size(), num_threads, [&](size_t k){
+    uint32_t* indices = hex ? part.cellPoints.data() + 8 * k : part.cellPoints.data() + part.cellPointsBegIndices[k] + 1;
+    uint32_t  count   = hex ? 8 : indices[-1];
+    for (uint32_t i = 0; i < count; i++)
+      indices[i] = static_cast<uint32_t>(std::lower_bound(global_points.begin(), global_points.end(), indices[i]) - global_points.begin());
+  }, grain);
+
+  part.points.resize(global_points.size());
+  part.pointVectors.resize(global_points.size());
+  parallel_for(0, global_points.size(), num_threads, [&](size_t p){
+    part.points[p]       = arrays.points[global_points[p]];
+    part.pointVectors[p] = arrays.pointVectors[global_points[p]];
+  }, grain);
+}
+
+// <output without .stadium>.<part><extension>
+inline std::string stadium_part_filename(const std::string& filename, uint32_t part, const std::string& extension){
+  std::string base = filename;
+  if (base.size() > 8 && base.compare(base.size() - 8, 8, ".stadium") == 0)
+    base.resize(base.size() - 8);
+  return base + "." + std::to_string(part) + extension;
+}
+
+// Partitions the generate_stadium arrays into num_parts parts and writes <output>.<k>.stadium and
+// <output>.<k>.part for every part k, one part in memory at a time. A BVH section is appended to
+// every part file when options.flags has STADIUM_FLAG_BVH.
+bool write_stadium_partition(const std::string& filename, const Stadium& stadium, const StadiumArrays& arrays, uint32_t num_parts,
+                             const StadiumWriteOptions& options = StadiumWriteOptions()){
+  std::vector<uint32_t> cell_part;
+  if (!compute_stadium_partition(stadium, arrays.cellBoxes.size(), num_parts, cell_part, options.num_threads))
+    return false;
+
+  std::vector<std::pair<uint32_t, uint32_t> > halo;
+  compute_stadium_halo(arrays, cell_part, halo, options.num_threads);
+
+  // owned cells and send lists of every part, both in CSR form
+  std::vector<size_t>   owned_begin(num_parts + 1, 0), send_begin(num_parts + 1, 0), ghost_begin(num_parts + 1, 0);
+  for (uint32_t part : cell_part)
+    owned_begin[part + 1]++;
+  for (const auto& pair : halo){
+    send_begin[cell_part[pair.second] + 1]++;
+    ghost_begin[pair.first + 1]++;
+  }
+  for (uint32_t p = 0; p < num_parts; p++){
+    owned_begin[p + 1] += owned_begin[p];
+    send_begin[p + 1]  += send_begin[p];
+    ghost_begin[p + 1] += ghost_begin[p];
+  }
+
+  std::vector<uint32_t> owned(cell_part.size());
+  std::vector<size_t>   fill(owned_begin.begin(), owned_begin.end() - 1);
+  for (size_t c = 0; c < cell_part.size(); c++)
+    owned[fill[cell_part[c]]++] = static_cast<uint32_t>(c);
+
+  std::vector<std::pair<uint32_t, uint32_t> > send(halo.size());
+  fill.assign(send_begin.begin(), send_begin.end() - 1);
+  for (const auto& pair : halo)
+    send[fill[cell_part[pair.second]]++] = pair;
+
+  for (uint32_t p = 0; p < num_parts; p++){
+    std::vector<uint32_t> cells(owned.begin() + owned_begin[p], owned.begin() + owned_begin[p + 1]);
+    for (size_t k = ghost_begin[p]; k < ghost_begin[p + 1]; k++)
+      cells.push_back(halo[k].second);
+
+    StadiumArrays         part;
+    std::vector<uint32_t> global_points;
+    extract_stadium_cells(arrays, cells, part, global_points, options.num_threads);
+    part.flags = arrays.flags | (options.flags & STADIUM_FLAG_BVH);
+
+    std::string stadium_filename = stadium_part_filename(filename, p, ".stadium");
+    if (!save_stadium(stadium_filename, part))
+      return false;
+
+    if (part.flags & STADIUM_FLAG_BVH){
+      StadiumBVH bvh;
+      build_stadium_bvh(part.cellBoxes.data(), part.cellBoxes.size(), bvh, options.num_threads);
+      if (!append_stadium_bvh(stadium_filename, bvh))
+        return false;
+    }
+
+    StadiumPartHeader header;
+    std::memcpy(header.magic, stadium_part_magic, sizeof(header.magic));
+    header.version         = stadium_part_version;
+    header.part            = p;
+    header.num_parts       = num_parts;
+    header.reserved        = 0;
+    header.num_owned_cells = owned_begin[p + 1] - owned_begin[p];
+    header.num_ghost_cells = ghost_begin[p + 1] - ghost_begin[p];
+    header.num_points      = global_points.size();
+    header.num_send        = send_begin[p + 1] - send_begin[p];
+    header.global_cells    = arrays.cellBoxes.size();
+    header.global_points   = arrays.points.size();
+
+    std::vector<uint32_t> ghost_owners, send_cells, send_parts;
+    for (size_t k = ghost_begin[p]; k < ghost_begin[p + 1]; k++)
+      ghost_owners.push_back(cell_part[halo[k].second]);
+    for (size_t k = send_begin[p]; k < send_begin[p + 1]; k++){
+      // the owned cells are in global order, their local id is found by bisection
+      uint32_t c = send[k].second;
+      send_cells.push_back(static_cast<uint32_t>(std::lower_bound(cells.begin(), cells.begin() + header.num_owned_cells, c) - cells.begin()));
+      send_parts.push_back(send[k].first);
+    }
+
+    std::string   part_filename = stadium_part_filename(filename, p, ".part");
+    std::ofstream out(part_filename.c_str(), std::ios_base::binary);
+    if (!out){
+      std::cout << "===> Cannot write " << part_filename << ".\n";
+      return false;
+    }
+
+    std::cout << "savePart: saving " << part_filename << " (" << header.num_owned_cells << " cells, "
+              << header.num_ghost_cells << " ghosts)" << std::endl;
+
+    out.write((const char*)(&header), sizeof(header));
+    out.write((const char*)(cells.data()),         sizeof(uint32_t)*cells.size());
+    out.write((const char*)(global_points.data()), sizeof(uint32_t)*global_points.size());
+    out.write((const char*)(ghost_owners.data()),  sizeof(uint32_t)*ghost_owners.size());
+    out.write((const char*)(send_cells.data()),    sizeof(uint32_t)*send_cells.size());
+    out.write((const char*)(send_parts.data()),    sizeof(uint32_t)*send_parts.size());
+    if (!out)
+      return false;
+  }
+
+  return true;
+}
+
+// The maps of a .part file, loaded next to the .stadium file of the same part.
+class StadiumPart {
+public:
+  StadiumPart(){
+    std::memset(&m_header, 0, sizeof(m_header));
+  }
+
+  bool open(const std::string& filename){
+    std::ifstream in(filename.c_str(), std::ios_base::binary);
+    if (!in)
+      return fail("cannot open " + filename);
+
+    if (!in.read((char*)(&m_header), sizeof(m_header)) || std::memcmp(m_header.magic, stadium_part_magic, sizeof(m_header.magic)) != 0)
+      return fail("not a stadium part file");
+
+    if (m_header.version != stadium_part_version)
+      return fail("unsupported stadium part version");
+
+    // the maps must fill the rest of the stream exactly, checked before anything is allocated
+    std::streamoff maps_begin = in.tellg();
+    in.seekg(0, std::ios_base::end);
+    std::streamoff stream_size = in.tellg();
+    in.seekg(maps_begin);
+    if (!in || stream_size < maps_begin)
+      return fail("truncated stadium part file");
+
+    uint64_t entries = static_cast<uint64_t>(stream_size - maps_begin) / sizeof(uint32_t);
+    if (m_header.num_owned_cells > entries || m_header.num_ghost_cells > entries || m_header.num_points > entries || m_header.num_send > entries ||
+        m_header.num_owned_cells + 2 * m_header.num_ghost_cells + m_header.num_points + 2 * m_header.num_send != entries ||
+        static_cast<uint64_t>(stream_size - maps_begin) != sizeof(uint32_t) * entries)
+      return fail("stadium part file size does not match the header");
+
+    if (m_header.part >= m_header.num_parts || m_header.num_owned_cells + m_header.num_ghost_cells > m_header.global_cells ||
+        m_header.num_points > m_header.global_points || (m_header.num_send + m_header.num_parts - 1) / m_header.num_parts > m_header.num_owned_cells)
+      return fail("invalid stadium part header");
+
+    m_cell_global_ids.resize(m_header.num_owned_cells + m_header.num_ghost_cells);
+    m_point_global_ids.resize(m_header.num_points);
+    m_ghost_owners.resize(m_header.num_ghost_cells);
+    m_send_cells.resize(m_header.num_send);
+    m_send_parts.resize(m_header.num_send);
+
+    in.read((char*)(m_cell_global_ids.data()),  sizeof(uint32_t)*m_cell_global_ids.size());
+    in.read((char*)(m_point_global_ids.data()), sizeof(uint32_t)*m_point_global_ids.size());
+    in.read((char*)(m_ghost_owners.data()),     sizeof(uint32_t)*m_ghost_owners.size());
+    in.read((char*)(m_send_cells.data()),       sizeof(uint32_t)*m_send_cells.size());
+    in.read((char*)(m_send_parts.data()),       sizeof(uint32_t)*m_send_parts.size());
+    if (!in)
+      return fail("truncated stadium part file");
+
+    for (uint32_t owner : m_ghost_owners)
+      if (owner >= m_header.num_parts || owner == m_header.part)
+        return fail("invalid ghost owner");
+    for (size_t k = 0; k < m_send_cells.size(); k++)
+      if (m_send_cells[k] >= m_header.num_owned_cells || m_send_parts[k] >= m_header.num_parts || m_send_parts[k] == m_header.part)
+        return fail("invalid send list");
+
+    return true;
+  }
+
+  uint32_t part() const { return m_header.part; }
+  uint32_t num_parts() const { return m_header.num_parts; }
+  size_t   num_owned_cells() const { return m_header.num_owned_cells; }
+  size_t   num_ghost_cells() const { return m_header.num_ghost_cells; }
+
+  // global id of every local cell (owned, then ghosts) and point
+  const std::vector<uint32_t>& cell_global_ids() const { return m_cell_global_ids; }
+  const std::vector<uint32_t>& point_global_ids() const { return m_point_global_ids; }
+
+  // owner of every ghost cell, ghost k is local cell num_owned_cells() + k
+  const std::vector<uint32_t>& ghost_owners() const { return m_ghost_owners; }
+
+  // owned cells to send and the parts receiving them
+  const std::vector<uint32_t>& send_cells() const { return m_send_cells; }
+  const std::vector<uint32_t>& send_parts() const { return m_send_parts; }
+
+  const std::string& error() const { return m_error; }
+
+private:
+  bool fail(const std::string& message){
+    m_cell_global_ids.clear();
+    m_point_global_ids.clear();
+    m_ghost_owners.clear();
+    m_send_cells.clear();
+    m_send_parts.clear();
+    m_error = message;
+    return false;
+  }
+
+  StadiumPartHeader     m_header;
+  std::vector<uint32_t> m_cell_global_ids;
+  std::vector<uint32_t> m_point_global_ids;
+  std::vector<uint32_t> m_ghost_owners;
+  std::vector<uint32_t> m_send_cells;
+  std::vector<uint32_t> m_send_parts;
+  std::string           m_error;
+};
+
+#endif
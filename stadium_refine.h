@@ -0,0 +1,361 @@
+#ifndef __STADIUM_REFINE_H__
+#define __STADIUM_REFINE_H__
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+#include "stadium_bvh.h"
+
+// Region around an embedded object that is refined: a set of boxes, e.g. the bounding box of the
+// object or the boxes of the triangles of its surface, indexed by a BVH. Coordinates are in the
+// space of the generated mesh.
+class StadiumRefineTarget {
+public:
+  void add_box(const AABB& box){
+    m_boxes.push_back(box);
+  }
+
+  // Adds the boxes of num_triangles triangles given by three vertex indices each.
+  void add_triangles(const float3* vertices, const uint32_t* triangles, size_t num_triangles){
+    for (size_t t = 0; t < num_triangles; t++){
+      AABB box;
+      for (int k = 0; k < 3; k++)
+        box.extend(vertices[triangles[3 * t + k]]);
+      m_boxes.push_back(box);
+    }
+  }
+
+  // Builds the BVH over the boxes, call it after the last add.
+  void build(unsigned num_threads = 0){
+    build_stadium_bvh(m_boxes.data(), m_boxes.size(), m_bvh, num_threads);
+  }
+
+  bool overlaps(const AABB& box) const {
+    return stadium_bvh_overlaps(StadiumBVHView(m_bvh, m_boxes.data()), box);
+  }
+
+  bool empty() const { return m_boxes.empty(); }
+
+private:
+  std::vector<AABB> m_boxes;
+  StadiumBVH        m_bvh;
+};
+
+// Deepest octree level below a stadium cell. The hanging node scan costs scale^2 per leaf face and
+// the fine lattice keys need (dims * 2^level + 1)^3 to fit 63 bits, so deeper levels are clamped.
+static const int stadium_refine_max_level = 6;
+
+struct StadiumRefineOptions {
+  int       max_level;      // octree levels below a stadium cell, a level halves the cell, at most stadium_refine_max_level
+  float     margin;         // distance around the target that is refined as well
+  unsigned  num_threads;    // 0 uses all hardware threads
+
+  StadiumRefineOptions(){
+    max_level   = 2;
+    margin      = 0.0f;
+    num_threads = 0;
+  }
+};
+
+// Cells and extra points of a block with refined cells, point indices local to the block.
+struct StadiumRefinedBlock {
+  std::vector<float3>   points;         // the points that are not on the block lattice
+  std::vector<uint32_t> cellPoints;     // count and point indices of every leaf, in cell order
+  std::vector<AABB>     cellBoxes;
+  std::vector<float>    cellVolumes;
+  size_t                refined_cells;  // stadium cells that were split
+  size_t                hanging_nodes;  // hanging node references in cellPoints
+
+  StadiumRefinedBlock(){
+    refined_cells = hanging_nodes = 0;
+  }
+};
+
+// Coordinate of the plane f of the block lattice refined scale times along the axis. Plane
+// d * scale is exactly StadiumBlock::coord(axis, d).
+inline float stadium_fine_coord(const StadiumBlock& block, int axis, int64_t f, int64_t scale){
+  float local = static_cast<float>(f) / static_cast<float>(block.dims[axis] * scale);
+  return (block.offset[axis] + local * block.elem_dim[axis]) * stadium_len[axis];
+}
+
+// Octree refinement of the cells of one block. A stadium cell whose box, grown by the margin,
+// overlaps the target is split into octants and every octant that still overlaps is split again,
+// down to max_level. Returns false and leaves out untouched when no cell of the block is refined.
+//
+// Every leaf is a hexahedron listing its 8 corners in the order of generate_block_cells, followed
+// by the hanging nodes: the corners of smaller neighbouring leaves that lie on its faces or edges.
+// Hanging nodes are resolved inside the block; the blocks do not share points in the generated
+// mesh, so there are none across block seams.
+bool refine_stadium_block(const StadiumBlock& block, const StadiumRefineTarget& target, const StadiumRefineOptions& options, StadiumRefinedBlock& out){
+  const int* dims   = block.dims;
+  int        levels = std::min(std::max(options.max_level, 0), stadium_refine_max_level);
+
+  // fewer levels for huge blocks, until the keys of the fine lattice points fit 63 bits
+  while (levels > 0){
+    uint64_t space = 1;
+    bool     fits  = true;
+    for (int a = 0; a < 3 && fits; a++){
+      uint64_t extent = (static_cast<uint64_t>(dims[a]) << levels) + 1;
+      fits  = space <= (uint64_t(1) << 63) / extent;
+      space = fits ? space * extent : space;
+    }
+    if (fits)
+      break;
+    levels--;
+  }
+
+  int64_t    scale   = int64_t(1) << levels;
+  int64_t    fine[3] = { dims[0] * scale, dims[1] * scale, dims[2] * scale };
+
+  auto box_of = [&](const int64_t* f, int64_t size){
+    AABB box;
+    for (int c = 0; c < 8; c++)
+      box.extend(float3(stadium_fine_coord(block, 0, f[0] + (c & 1) * size, scale),
+                        stadium_fine_coord(block, 1, f[1] + ((c >> 1) & 1) * size, scale),
+                        stadium_fine_coord(block, 2, f[2] + (c >> 2) * size, scale)));
+    return box;
+  };
+  auto grow = [&](AABB box){
+    for (int a = 0; a < 3; a++){
+      box.min.v[a] -= options.margin;
+      box.max.v[a] += options.margin;
+    }
+    return box;
+  };
+
+  // the whole block first, most blocks are far from the target
+  AABB block_box;
+  block_box.extend(float3(block.coord(0, 0), block.coord(1, 0), block.coord(2, 0)));
+  block_box.extend(float3(block.coord(0, dims[0]), block.coord(1, dims[1]), block.coord(2, dims[2])));
+  if (levels == 0 || !target.overlaps(grow(block_box)))
+    return false;
+
+  size_t num_cells = block.num_cells();
+  std::vector<uint8_t> marked(num_cells, 0);
+  size_t               num_marked = 0;
+  size_t               c = 0;
+  for (int d0 = 0; d0 < dims[0]; d0++)
+    for (int d1 = 0; d1 < dims[1]; d1++)
+      for (int d2 = 0; d2 < dims[2]; d2++, c++){
+        int64_t f[3] = { d0 * scale, d1 * scale, d2 * scale };
+        marked[c] = target.overlaps(grow(box_of(f, scale)));
+        num_marked += marked[c];
+      }
+
+  if (num_marked == 0)
+    return false;
+
+  struct Leaf {
+    int64_t f[3];
+    int64_t size;
+    bool    near;       // inside or next to a split stadium cell, may have hanging nodes
+  };
+
+  std::vector<Leaf> leaves;
+  leaves.reserve(num_cells + 7 * num_marked);
+
+  std::vector<Leaf> stack;
+  c = 0;
+  for (int d0 = 0; d0 < dims[0]; d0++)
+    for (int d1 = 0; d1 < dims[1]; d1++)
+      for (int d2 = 0; d2 < dims[2]; d2++, c++){
+        Leaf cell = { { d0 * scale, d1 * scale, d2 * scale }, scale, false };
+
+        if (!marked[c]){
+          for (int n = 0; n < 27 && !cell.near; n++){
+            int e0 = d0 + n % 3 - 1, e1 = d1 + (n / 3) % 3 - 1, e2 = d2 + n / 9 - 1;
+            if (e0 >= 0 && e0 < dims[0] && e1 >= 0 && e1 < dims[1] && e2 >= 0 && e2 < dims[2])
+              cell.near = marked[(static_cast<size_t>(e0) * dims[1] + e1) * dims[2] + e2] != 0;
+          }
+          leaves.push_back(cell);
+          continue;
+        }
+
+        // depth first split, the octants in the d0 -> d1 -> d2 order of the cells
+        out.refined_cells++;
+        cell.near = true;
+        stack.push_back(cell);
+        while (!stack.empty()){
+          Leaf leaf = stack.back();
+          stack.pop_back();
+
+          if (leaf.size > 1 && (leaf.size == scale || target.overlaps(grow(box_of(leaf.f, leaf.size))))){
+            int64_t half = leaf.size / 2;
+            for (int o = 7; o >= 0; o--){
+              Leaf child = { { leaf.f[0] + ((o >> 2) & 1) * half, leaf.f[1] + ((o >> 1) & 1) * half, leaf.f[2] + (o & 1) * half }, half, true };
+              stack.push_back(child);
+            }
+            continue;
+          }
+          leaves.push_back(leaf);
+        }
+      }
+
+  // lattice points keep their generate_block_points index, the others are numbered after them
+  size_t  num_lattice = block.num_points();
+  int64_t s1          = dims[2] + 1;
+  int64_t s0          = (dims[1] + 1) * s1;
+
+  auto key_of = [&](int64_t f0, int64_t f1, int64_t f2){
+    return static_cast<uint64_t>((f0 * (fine[1] + 1) + f1) * (fine[2] + 1) + f2);
+  };
+
+  std::unordered_map<uint64_t, uint32_t> extra;
+  auto point_of = [&](int64_t f0, int64_t f1, int64_t f2){
+    if (f0 % scale == 0 && f1 % scale == 0 && f2 % scale == 0)
+      return static_cast<uint32_t>(f0 / scale * s0 + f1 / scale * s1 + f2 / scale);
+
+    auto it = extra.find(key_of(f0, f1, f2));
+    if (it != extra.end())
+      return it->second;
+
+    uint32_t index = static_cast<uint32_t>(num_lattice + out.points.size());
+    extra[key_of(f0, f1, f2)] = index;
+    out.points.push_back(float3(stadium_fine_coord(block, 0, f0, scale), stadium_fine_coord(block, 1, f1, scale), stadium_fine_coord(block, 2, f2, scale)));
+    return index;
+  };
+
+  // corner offsets in the order of generate_block_cells
+  static const int corner[8][3] = {
+    { 0, 0, 0 }, { 1, 0, 0 }, { 1, 0, 1 }, { 0, 0, 1 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 1, 1 }, { 0, 1, 1 }
+  };
+
+  std::vector<uint32_t> corners(8 * leaves.size());
+  for (size_t l = 0; l < leaves.size(); l++)
+    for (int k = 0; k < 8; k++)
+      corners[8 * l + k] = point_of(leaves[l].f[0] + corner[k][0] * leaves[l].size,
+                                    leaves[l].f[1] + corner[k][1] * leaves[l].size,
+                                    leaves[l].f[2] + corner[k][2] * leaves[l].size);
+
+  out.cellPoints.reserve(9 * leaves.size());
+  out.cellBoxes.reserve(leaves.size());
+  out.cellVolumes.reserve(leaves.size());
+
+  std::vector<uint32_t> hanging;
+  for (size_t l = 0; l < leaves.size(); l++){
+    const Leaf& leaf = leaves[l];
+
+    // the points of smaller leaves on the faces of this one, all of them are extra points
+    hanging.clear();
+    if (leaf.near && leaf.size > 1 && !extra.empty()){
+      int64_t lo[3] = { leaf.f[0], leaf.f[1], leaf.f[2] };
+      int64_t hi[3] = { leaf.f[0] + leaf.size, leaf.f[1] + leaf.size, leaf.f[2] + leaf.size };
+      for (int64_t f0 = lo[0]; f0 <= hi[0]; f0++)
+        for (int64_t f1 = lo[1]; f1 <= hi[1]; f1++){
+          bool    face = f0 == lo[0] || f0 == hi[0] || f1 == lo[1] || f1 == hi[1];
+          int64_t step = face ? 1 : leaf.size;
+          for (int64_t f2 = lo[2]; f2 <= hi[2]; f2 += step){
+            int on_bounds = (f0 == lo[0] || f0 == hi[0]) + (f1 == lo[1] || f1 == hi[1]) + (f2 == lo[2] || f2 == hi[2]);
+            if (on_bounds == 3)
+              continue;
+            auto it = extra.find(key_of(f0, f1, f2));
+            if (it != extra.end())
+              hanging.push_back(it->second);
+          }
+        }
+    }
+
+    out.cellPoints.push_back(static_cast<uint32_t>(8 + hanging.size()));
+    out.cellPoints.insert(out.cellPoints.end(), corners.begin() + 8 * l, corners.begin() + 8 * l + 8);
+    out.cellPoints.insert(out.cellPoints.end(), hanging.begin(), hanging.end());
+    out.hanging_nodes += hanging.size();
+
+    AABB box = box_of(leaf.f, leaf.size);
+    out.cellBoxes.push_back(box);
+    out.cellVolumes.push_back(stadium_cell_volume(box.max.v[0] - box.min.v[0], box.max.v[1] - box.min.v[1], box.max.v[2] - box.min.v[2]));
+  }
+
+  return true;
+}
+
+// Generates the stadium into arrays like generate_stadium, with the cells near the target refined
+// by refine_stadium_block. The output is in the general layout, the cells with hanging nodes have
+// more than 8 points. The blocks far from the target are generated as usual; every block keeps its
+// lattice points first, followed by the points added by the refinement. refined_cells receives
+// the number of stadium cells that were split. Fails, leaving arrays untouched, when the refined
+// points or connectivity entries overflow the 32-bit indices.
+bool refine_stadium(const Stadium& stadium, const StadiumRefineTarget& target, StadiumArrays& arrays, size_t& refined_cells,
+                    const StadiumRefineOptions& options = StadiumRefineOptions()){
+  std::vector<StadiumBlock> blocks;
+  compute_stadium_blocks(stadium, blocks);
+
+  std::vector<StadiumRefinedBlock> refined(blocks.size());
+  std::vector<uint8_t>             is_refined(blocks.size(), 0);
+  parallel_for(0, blocks.size(), options.num_threads, [&](size_t b){
+    is_refined[b] = refine_stadium_block(blocks[b], target, options, refined[b]);
+  });
+
+  // new offsets of the blocks: points, cells and cellPoints entries
+  std::vector<size_t> first_point(blocks.size() + 1, 0), first_cell(blocks.size() + 1, 0), first_entry(blocks.size() + 1, 0);
+  refined_cells = 0;
+  for (size_t b = 0; b < blocks.size(); b++){
+    size_t points  = blocks[b].num_points() + (is_refined[b] ? refined[b].points.size() : 0);
+    size_t cells   = is_refined[b] ? refined[b].cellBoxes.size() : blocks[b].num_cells();
+    size_t entries = is_refined[b] ? refined[b].cellPoints.size() : 9 * blocks[b].num_cells();
+
+    first_point[b + 1] = first_point[b] + points;
+    first_cell[b + 1]  = first_cell[b] + cells;
+    first_entry[b + 1] = first_entry[b] + entries;
+    refined_cells     += refined[b].refined_cells;
+  }
+
+  size_t num_points = first_point[blocks.size()];
+  size_t num_cells  = first_cell[blocks.size()];
+
+  // the local point indices of the blocks and the begin indices are narrowed to 32 bits below
+  if (num_points > UINT32_MAX || first_entry[blocks.size()] > UINT32_MAX)
+    return false;
+
+  arrays.flags = 0;
+  arrays.points.resize(num_points);
+  arrays.cellPoints.resize(first_entry[blocks.size()]);
+  arrays.cellPointsBegIndices.resize(num_cells);
+  arrays.cellBoxes.resize(num_cells);
+  arrays.cellVolumes.resize(num_cells);
+  arrays.cellVectors.assign(num_cells, float3(0.0f, 0.0f, 1.0f));
+  arrays.pointVectors.assign(num_points, float3(0.0f, 0.0f, 1.0f));
+
+  StadiumCellTemplates templates;
+  build_stadium_cell_templates(stadium, 0, templates, options.num_threads);
+
+  parallel_for(0, blocks.size(), options.num_threads, [&](size_t b){
+    StadiumBlock block = blocks[b];
+    block.first_point  = first_point[b];
+    block.first_cell   = first_cell[b];
+
+    generate_block_points(block, arrays.points.data() + block.first_point);
+
+    uint32_t* cellPoints  = arrays.cellPoints.data() + first_entry[b];
+    uint32_t* begIndices  = arrays.cellPointsBegIndices.data() + block.first_cell;
+    uint32_t  offset      = static_cast<uint32_t>(block.first_point);
+
+    if (!is_refined[b]){
+      emit_block_cells(block, templates, cellPoints, 0);
+      for (size_t k = 0; k < block.num_cells(); k++)
+        begIndices[k] = static_cast<uint32_t>(first_entry[b] + 9 * k);
+      generate_block_boxes_volumes(block, arrays.cellBoxes.data() + block.first_cell, arrays.cellVolumes.data() + block.first_cell);
+      return;
+    }
+
+    const StadiumRefinedBlock& local = refined[b];
+    std::copy(local.points.begin(), local.points.end(), arrays.points.begin() + block.first_point + block.num_points());
+    std::copy(local.cellBoxes.begin(), local.cellBoxes.end(), arrays.cellBoxes.begin() + block.first_cell);
+    std::copy(local.cellVolumes.begin(), local.cellVolumes.end(), arrays.cellVolumes.begin() + block.first_cell);
+
+    size_t entry = 0;
+    for (size_t k = 0; k < local.cellBoxes.size(); k++){
+      uint32_t count = local.cellPoints[entry];
+      begIndices[k]  = static_cast<uint32_t>(first_entry[b] + entry);
+      cellPoints[entry] = count;
+      stadium_add_offset(local.cellPoints.data() + entry + 1, count, offset, cellPoints + entry + 1);
+      entry += 1 + count;
+    }
+  });
+
+  return true;
+}
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef __STADIUM_REORDER_H__
+#define __STADIUM_REORDER_H__
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+#include "stadium_bvh.h"
+
+enum StadiumCurve {
+  STADIUM_CURVE_MORTON,       // Z-order, cheapest key
+  STADIUM_CURVE_HILBERT       // no jumps between consecutive octants, better locality
+};
+
+struct StadiumReorderOptions {
+  StadiumCurve curve;
+  unsigned     num_threads;     // 0 uses all hardware threads
+
+  StadiumReorderOptions(){
+    curve       = STADIUM_CURVE_HILBERT;
+    num_threads = 0;
+  }
+};
+
+// 63-bit Hilbert index of p inside bounds, 21 bits per axis. The quantized coordinates are turned
+// into the transposed Hilbert index (Skilling, "Programming the Hilbert curve", 2004) and then
+// interleaved like a Morton code.
+inline uint64_t stadium_hilbert_code(const float3& p, const AABB& bounds){
+  uint32_t x[3];
+  for (int a = 0; a < 3; a++){
+    float extent = bounds.max.v[a] - bounds.min.v[a];
+    float t      = extent > 0.0f ? (p.v[a] - bounds.min.v[a]) / extent : 0.0f;
+    x[a] = static_cast<uint32_t>(std::min(std::max(t, 0.0f), 1.0f) * 2097151.0f);
+  }
+
+  // inverse undo
+  for (uint32_t q = 1u << 20; q > 1; q >>= 1){
+    uint32_t mask = q - 1;
+    for (int a = 0; a < 3; a++){
+      if (x[a] & q)
+        x[0] ^= mask;
+      else {
+        uint32_t t = (x[0] ^ x[a]) & mask;
+        x[0] ^= t;
+        x[a] ^= t;
+      }
+    }
+  }
+
+  // gray encode
+  x[1] ^= x[0];
+  x[2] ^= x[1];
+  uint32_t t = 0;
+  for (uint32_t q = 1u << 20; q > 1; q >>= 1)
+    if (x[2] & q)
+      t ^= q - 1;
+  for (int a = 0; a < 3; a++)
+    x[a] ^= t;
+
+  return stadium_morton_expand(x[0]) << 2 | stadium_morton_expand(x[1]) << 1 | stadium_morton_expand(x[2]);
+}
+
+// Order of count items sorted by the curve key of their positions: order[new] = old. Ties keep the
+// original order.
+template <typename Position>
+void compute_stadium_curve_order(size_t count, Position position, const AABB& bounds, StadiumCurve curve,
+                                 std::vector<uint32_t>& order, unsigned num_threads){
+  const size_t grain = 1 << 16;
+
+  std::vector<std::pair<uint64_t, uint32_t> > keys(count);
+  parallel_for(0, count, num_threads, [&](size_t k){
+    float3 p = position(k);
+    keys[k] = std::make_pair(curve == STADIUM_CURVE_HILBERT ? stadium_hilbert_code(p, bounds) : stadium_morton_code(p, bounds),
+                             static_cast<uint32_t>(k));
+  }, grain);
+
+  parallel_sort(keys.begin(), keys.end(), num_threads, [](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b){
+    return a < b;
+  });
+
+  order.resize(count);
+  parallel_for(0, count, num_threads, [&](size_t k){
+    order[k] = keys[k].second;
+  }, grain);
+}
+
+// dst[k] = src[order[k]], then swapped into src.
+template <typename T>
+void stadium_permute(std::vector<T>& src, const std::vector<uint32_t>& order, unsigned num_threads){
+  if (src.empty())
+    return;
+
+  std::vector<T> dst(src.size());
+  parallel_for(0, dst.size(), num_threads, [&](size_t k){
+    dst[k] = src[order[k]];
+  }, 1 << 16);
+  src.swap(dst);
+}
+
+// Sorts the cells by the curve key of their box centers and the points by the curve key of their
+// positions, so cells and points that are close in space are close in memory across the block and
+// layer seams. Every per-cell and per-point array is permuted, and cellPoints is rebuilt in the new
+// cell order with the renumbered points. Cells of any length in the general layout are kept whole.
+// The keys, the sorts and the permutations run on num_threads workers.
+void reorder_stadium(StadiumArrays& arrays, const StadiumReorderOptions& options = StadiumReorderOptions()){
+  const size_t grain       = 1 << 16;
+  size_t       num_cells   = arrays.cellBoxes.size();
+  size_t       num_points  = arrays.points.size();
+  unsigned     num_threads = options.num_threads;
+
+  if (num_points == 0)
+    return;
+
+  // one bounds for both curves, one partial box per chunk
+  std::vector<AABB> partial((num_points + grain - 1) / grain);
+  parallel_for(0, partial.size(), num_threads, [&](size_t chunk){
+    for (size_t p = chunk * grain; p < std::min(num_points, (chunk + 1) * grain); p++)
+      partial[chunk].extend(arrays.points[p]);
+  });
+  AABB bounds;
+  for (const AABB& box : partial){
+    bounds.extend(box.min);
+    bounds.extend(box.max);
+  }
+
+  std::vector<uint32_t> cell_order, point_order;
+  compute_stadium_curve_order(num_cells, [&](size_t c){ return stadium_box_center(arrays.cellBoxes[c]); }, bounds,
+                              options.curve, cell_order, num_threads);
+  compute_stadium_curve_order(num_points, [&](size_t p){ return arrays.points[p]; }, bounds,
+                              options.curve, point_order, num_threads);
+
+  std::vector<uint32_t> point_index(num_points);
+  parallel_for(0, num_points, num_threads, [&](size_t p){
+    point_index[point_order[p]] = static_cast<uint32_t>(p);
+  }, grain);
+
+  // connectivity in the new cell order with the new point ids
+  std::vector<uint32_t> cellPoints(arrays.cellPoints.size());
+  if (arrays.flags & STADIUM_FLAG_HEX8){
+    parallel_for(0, num_cells, num_threads, [&](size_t c){
+      const uint32_t* src = arrays.cellPoints.data() + 8 * static_cast<size_t>(cell_order[c]);
+      for (int k = 0; k < 8; k++)
+        cellPoints[8 * c + k] = point_index[src[k]];
+    }, grain);
+  }
+  else {
+    std::vector<uint32_t> begIndices(num_cells);
+    uint32_t entry = 0;
+    for (size_t c = 0; c < num_cells; c++){
+      begIndices[c] = entry;
+      entry        += arrays.cellPoints[arrays.cellPointsBegIndices[cell_order[c]]] + 1;
+    }
+
+    parallel_for(0, num_cells, num_threads, [&](size_t c){
+      const uint32_t* src = arrays.cellPoints.data() + arrays.cellPointsBegIndices[cell_order[c]];
+      uint32_t*       dst = cellPoints.data() + begIndices[c];
+      dst[0] = src[0];
+      for (uint32_t k = 1; k <= src[0]; k++)
+        dst[k] = point_index[src[k]];
+    }, grain);
+
+    arrays.cellPointsBegIndices.swap(begIndices);
+  }
+  arrays.cellPoints.swap(cellPoints);
+
+  stadium_permute(arrays.cellBoxes, cell_order, num_threads);
+  stadium_permute(arrays.cellVectors, cell_order, num_threads);
+  stadium_permute(arrays.cellVolumes, cell_order, num_threads);
+  stadium_permute(arrays.points, point_order, num_threads);
+  stadium_permute(arrays.pointVectors, point_order, num_threads);
+}
+
+#endif
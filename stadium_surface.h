@@ -0,0 +1,227 @@
+#ifndef __STADIUM_SURFACE_H__
+#define __STADIUM_SURFACE_H__
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+
+// A compact preview of a stadium: its own points and either triangles (3 indices each) or line
+// pairs (2 indices each) into them. The points use the coordinates of the generated mesh.
+struct StadiumSurface {
+  std::vector<float3>   points;
+  std::vector<uint32_t> indices;
+};
+
+// A rectangle [lo[0], hi[0]] x [lo[1], hi[1]] in the plane of a face.
+struct StadiumRect {
+  float lo[2];
+  float hi[2];
+};
+
+// Appends the up to four pieces of r left outside of the rectangle f to pieces. Pieces thinner than
+// eps are dropped.
+inline void stadium_rect_subtract(const StadiumRect& r, const StadiumRect& f, float eps, std::vector<StadiumRect>& pieces){
+  if (f.lo[0] >= r.hi[0] - eps || f.hi[0] <= r.lo[0] + eps || f.lo[1] >= r.hi[1] - eps || f.hi[1] <= r.lo[1] + eps){
+    pieces.push_back(r);
+    return;
+  }
+
+  // the strips below and above f along u span the whole of r, the ones beside it only the overlap
+  float u0 = std::max(r.lo[0], f.lo[0]), u1 = std::min(r.hi[0], f.hi[0]);
+  StadiumRect strips[4] = {
+    { { r.lo[0], r.lo[1] }, { u0,      r.hi[1] } },
+    { { u1,      r.lo[1] }, { r.hi[0], r.hi[1] } },
+    { { u0,      r.lo[1] }, { u1,      f.lo[1] } },
+    { { u0,      f.hi[1] }, { u1,      r.hi[1] } }
+  };
+  for (const StadiumRect& strip : strips)
+    if (strip.hi[0] - strip.lo[0] > eps && strip.hi[1] - strip.lo[1] > eps)
+      pieces.push_back(strip);
+}
+
+// Adds the cell faces of the lattice face of the block across axis at side 0 (d = 0) or 1
+// (d = dims) as two triangles each, wound to face outwards. The parts of the cell faces lying
+// inside the footprint of a layer right against this one, stacked along z or beside it along x
+// or y, are hidden: faces fully inside are left out and faces across the rim of the footprint are
+// cut to the visible pieces. Only the points used by the kept faces are added; the pieces get
+// points of their own and the faces of different blocks share none.
+void add_block_face(const Stadium& stadium, const StadiumBlock& block, int axis, int side, StadiumSurface& surface){
+  static const int   face_u[3]    = { 1, 0, 0 };
+  static const int   face_v[3]    = { 2, 2, 1 };
+  static const float face_sign[3] = { 1.0f, -1.0f, 1.0f };    // orientation of u x v along axis
+
+  int   u     = face_u[axis];
+  int   v     = face_v[axis];
+  int   nu    = block.dims[u];
+  int   nv    = block.dims[v];
+  float plane = block.coord(axis, side ? block.dims[axis] : 0);
+
+  // footprints of the layers with a face in the plane of this one, stacked along z or side by side
+  std::vector<StadiumRect> footprints;
+  const AABB& box   = stadium.layer_bbox[block.layer];
+  float       level = side ? box.max.v[axis] : box.min.v[axis];
+  for (int k = 0; k < stadium.num_layers; k++){
+    const AABB& other = stadium.layer_bbox[k];
+    if (k == block.layer || (other.min.v[axis] != level && other.max.v[axis] != level))
+      continue;
+
+    StadiumRect f;
+    int         face_axes[2] = { u, v };
+    for (int a = 0; a < 2; a++){
+      f.lo[a] = std::min(other.min.v[face_axes[a]], other.max.v[face_axes[a]]) * stadium_len[face_axes[a]];
+      f.hi[a] = std::max(other.min.v[face_axes[a]], other.max.v[face_axes[a]]) * stadium_len[face_axes[a]];
+    }
+    footprints.push_back(f);
+  }
+
+  std::vector<float> us(nu + 1), vs(nv + 1);
+  for (int k = 0; k <= nu; k++) us[k] = block.coord(u, k);
+  for (int k = 0; k <= nv; k++) vs[k] = block.coord(v, k);
+
+  // flip the winding when u x v does not point out of the block
+  float outward    = side ? block.coord(axis, block.dims[axis]) - block.coord(axis, 0)
+                          : block.coord(axis, 0) - block.coord(axis, block.dims[axis]);
+  float normal     = face_sign[axis] * (us[nu] - us[0]) * (vs[nv] - vs[0]);
+  bool  flip       = (normal < 0.0f) != (outward < 0.0f);
+  bool  flip_piece = (face_sign[axis] < 0.0f) != (outward < 0.0f);
+  float eps        = 1.0e-6f * std::max(std::max(std::fabs(us[0]), std::fabs(us[nu])), std::max(std::fabs(vs[0]), std::fabs(vs[nv])));
+
+  const uint32_t        none = UINT32_MAX;
+  std::vector<uint32_t> index(static_cast<size_t>(nu + 1) * (nv + 1), none);
+
+  auto new_point = [&](float pu, float pv){
+    float3 p;
+    p.v[axis] = plane;
+    p.v[u]    = pu;
+    p.v[v]    = pv;
+    surface.points.push_back(p);
+    return static_cast<uint32_t>(surface.points.size() - 1);
+  };
+  auto lattice_point = [&](int a, int b){
+    uint32_t& id = index[static_cast<size_t>(a) * (nv + 1) + b];
+    if (id == none)
+      id = new_point(us[a], vs[b]);
+    return id;
+  };
+  auto add_quad = [&](uint32_t p0, uint32_t p1, uint32_t p2, uint32_t p3, bool flipped){
+    if (flipped)
+      std::swap(p1, p3);
+    uint32_t quad[6] = { p0, p1, p2, p0, p2, p3 };
+    surface.indices.insert(surface.indices.end(), quad, quad + 6);
+  };
+
+  std::vector<StadiumRect> pieces, rest;
+  for (int a = 0; a < nu; a++)
+    for (int b = 0; b < nv; b++){
+      StadiumRect cell = { { std::min(us[a], us[a + 1]), std::min(vs[b], vs[b + 1]) },
+                           { std::max(us[a], us[a + 1]), std::max(vs[b], vs[b + 1]) } };
+
+      pieces.assign(1, cell);
+      for (size_t k = 0; k < footprints.size() && !pieces.empty(); k++){
+        rest.clear();
+        for (const StadiumRect& piece : pieces)
+          stadium_rect_subtract(piece, footprints[k], eps, rest);
+        pieces.swap(rest);
+      }
+
+      if (pieces.size() == 1 && std::equal(pieces[0].lo, pieces[0].lo + 2, cell.lo) && std::equal(pieces[0].hi, pieces[0].hi + 2, cell.hi)){
+        add_quad(lattice_point(a, b), lattice_point(a + 1, b), lattice_point(a + 1, b + 1), lattice_point(a, b + 1), flip);
+        continue;
+      }
+
+      for (const StadiumRect& piece : pieces)
+        add_quad(new_point(piece.lo[0], piece.lo[1]), new_point(piece.hi[0], piece.lo[1]),
+                 new_point(piece.hi[0], piece.hi[1]), new_point(piece.lo[0], piece.hi[1]), flip_piece);
+    }
+}
+
+// Extracts the boundary of the stadium as triangles. Inside a layer the blocks tile the layer box,
+// so only the block faces on the sides of the layer are kept, less the parts covered by a layer
+// right against them. The shell is only geometrically watertight: the triangles cover the
+// boundary without gaps, but points are not shared across blocks and cut pieces leave T-junctions,
+// so weld and split them before using it as a closed mesh. The work and the output follow the
+// area of the surface, not the number of cells.
+void extract_stadium_boundary(const Stadium& stadium, StadiumSurface& surface){
+  surface.points.clear();
+  surface.indices.clear();
+
+  for (int l = 0; l < stadium.num_layers; l++){
+    const StadiumLayerType& layer_type = stadium.layer_types[stadium.layers[l]];
+
+    for (int i = 0; i < layer_type.rows; i++){
+      for (int j = 0; j < layer_type.cols; j++){
+        StadiumBlock block;
+        init_stadium_block(stadium, l, i, j, block);
+
+        if (i == 0)                   add_block_face(stadium, block, 0, 0, surface);
+        if (i == layer_type.rows - 1) add_block_face(stadium, block, 0, 1, surface);
+        if (j == 0)                   add_block_face(stadium, block, 1, 0, surface);
+        if (j == layer_type.cols - 1) add_block_face(stadium, block, 1, 1, surface);
+        add_block_face(stadium, block, 2, 0, surface);
+        add_block_face(stadium, block, 2, 1, surface);
+      }
+    }
+  }
+}
+
+// Extracts the outlines of the blocks, and with them of the layers, as line pairs. Every layer
+// adds the (rows + 1) x (cols + 1) block corners at its bottom and its top once, and the edges
+// between them once, whatever the resolution of the blocks.
+void extract_stadium_outlines(const Stadium& stadium, StadiumSurface& surface){
+  surface.points.clear();
+  surface.indices.clear();
+
+  for (int l = 0; l < stadium.num_layers; l++){
+    const StadiumLayerType& layer_type = stadium.layer_types[stadium.layers[l]];
+    int                     rows       = layer_type.rows;
+    int                     cols       = layer_type.cols;
+
+    // corner planes taken from the blocks, so they match the generated points
+    std::vector<float> xs(rows + 1), ys(cols + 1);
+    float              zs[2];
+    StadiumBlock       block;
+    for (int i = 0; i < rows; i++){
+      init_stadium_block(stadium, l, i, 0, block);
+      xs[i]     = block.coord(0, 0);
+      xs[i + 1] = block.coord(0, block.dims[0]);
+    }
+    for (int j = 0; j < cols; j++){
+      init_stadium_block(stadium, l, 0, j, block);
+      ys[j]     = block.coord(1, 0);
+      ys[j + 1] = block.coord(1, block.dims[1]);
+    }
+    zs[0] = block.coord(2, 0);
+    zs[1] = block.coord(2, block.dims[2]);
+
+    uint32_t first = static_cast<uint32_t>(surface.points.size());
+    auto     index = [&](int s, int i, int j){
+      return first + static_cast<uint32_t>((s * (rows + 1) + i) * (cols + 1) + j);
+    };
+
+    for (int s = 0; s < 2; s++)
+      for (int i = 0; i <= rows; i++)
+        for (int j = 0; j <= cols; j++)
+          surface.points.push_back(float3(xs[i], ys[j], zs[s]));
+
+    for (int i = 0; i <= rows; i++)
+      for (int j = 0; j <= cols; j++){
+        for (int s = 0; s < 2; s++){
+          if (i < rows){
+            surface.indices.push_back(index(s, i, j));
+            surface.indices.push_back(index(s, i + 1, j));
+          }
+          if (j < cols){
+            surface.indices.push_back(index(s, i, j));
+            surface.indices.push_back(index(s, i, j + 1));
+          }
+        }
+        surface.indices.push_back(index(0, i, j));
+        surface.indices.push_back(index(1, i, j));
+      }
+  }
+}
+
+#endif
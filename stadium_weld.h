@@ -0,0 +1,251 @@
+#ifndef __STADIUM_WELD_H__
+#define __STADIUM_WELD_H__
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+
+// Calls fn(p) for every point on the faces of the block lattice, in increasing index order. p is
+// the index of the point inside the block.
+template <typename Fn>
+void for_each_block_boundary_point(const StadiumBlock& block, Fn fn){
+  const int* dims = block.dims;
+
+  for (int d0 = 0; d0 <= dims[0]; d0++)
+    for (int d1 = 0; d1 <= dims[1]; d1++){
+      size_t row  = (static_cast<size_t>(d0) * (dims[1] + 1) + d1) * (dims[2] + 1);
+      bool   face = d0 == 0 || d0 == dims[0] || d1 == 0 || d1 == dims[1];
+
+      if (face){
+        for (int d2 = 0; d2 <= dims[2]; d2++)
+          fn(row + d2);
+      }
+      else {
+        fn(row);
+        if (dims[2] > 0)
+          fn(row + dims[2]);
+      }
+    }
+}
+
+// Merges the coincident points on the shared faces of the blocks generated by generate_stadium.
+//
+// Blocks next to each other in a layer whose lattices conform on the shared face are merged
+// through the known face layout. Every remaining boundary point, e.g. on the seams between
+// stacked layers or between blocks of different sizes, is sorted by its grid cell of size
+// tolerance and merged with the earliest point before it closer than tolerance, following that
+// point's own merge. The first occurrence of a point is kept, the points are compacted, and
+// cellPoints and pointVectors are remapped. All passes, the sort included, run on num_threads
+// workers.
+//
+// Returns the number of removed points. Afterwards the points no longer follow the block layout
+// of compute_stadium_blocks.
+size_t weld_stadium_points(const Stadium& stadium, StadiumArrays& arrays, float tolerance = 1.0e-5f, unsigned num_threads = 0){
+  std::vector<StadiumBlock> blocks;
+  compute_stadium_blocks(stadium, blocks);
+
+  size_t num_points = arrays.points.size();
+
+  // remap[p] is the earlier point p is merged into, or p itself
+  std::vector<uint32_t> remap(num_points);
+  parallel_for(0, num_points, num_threads, [&](size_t p){
+    remap[p] = static_cast<uint32_t>(p);
+  }, 1 << 16);
+
+  // the faces shared with the previous block along i and along j, as drawn by the wireframe
+  StadiumBlockGrid     grid;
+  std::vector<uint8_t> seams;
+  compute_stadium_block_grid(blocks, grid);
+  compute_stadium_seams(blocks, grid, seams);
+
+  // structured pass: the points of the shared faces go to the previous block
+  parallel_for(0, blocks.size(), num_threads, [&](size_t b){
+    const StadiumBlock& block = blocks[b];
+    const int*          dims  = block.dims;
+
+    if (seams[b] & STADIUM_SEAM_I){
+      const StadiumBlock& prev      = blocks[grid.index(block.layer, block.i - 1, block.j)];
+      size_t              prev_face = prev.first_point + static_cast<size_t>(prev.dims[0]) * (dims[1] + 1) * (dims[2] + 1);
+      for (size_t k = 0; k < static_cast<size_t>(dims[1] + 1) * (dims[2] + 1); k++)
+        remap[block.first_point + k] = static_cast<uint32_t>(prev_face + k);
+    }
+
+    if (seams[b] & STADIUM_SEAM_J){
+      const StadiumBlock& prev = blocks[grid.index(block.layer, block.i, block.j - 1)];
+      for (int d0 = 0; d0 <= dims[0]; d0++)
+        for (int d2 = 0; d2 <= dims[2]; d2++){
+          size_t p = block.first_point + static_cast<size_t>(d0) * (dims[1] + 1) * (dims[2] + 1) + d2;
+          size_t q = prev.first_point + (static_cast<size_t>(d0) * (dims[1] + 1) + prev.dims[1]) * (dims[2] + 1) + d2;
+          // keep the i-seam mapping of the corner column, both lead to the same point
+          if (remap[p] == p)
+            remap[p] = static_cast<uint32_t>(q);
+        }
+    }
+  });
+
+  // boundary points of every block, in increasing index order
+  std::vector<size_t> block_boundary(blocks.size() + 1, 0);
+  parallel_for(0, blocks.size(), num_threads, [&](size_t b){
+    size_t count = 0;
+    for_each_block_boundary_point(blocks[b], [&](size_t){ count++; });
+    block_boundary[b + 1] = count;
+  });
+  for (size_t b = 0; b < blocks.size(); b++)
+    block_boundary[b + 1] += block_boundary[b];
+
+  std::vector<uint32_t> boundary(block_boundary[blocks.size()]);
+  parallel_for(0, blocks.size(), num_threads, [&](size_t b){
+    size_t next = block_boundary[b];
+    for_each_block_boundary_point(blocks[b], [&](size_t local){
+      boundary[next++] = static_cast<uint32_t>(blocks[b].first_point + local);
+    });
+  });
+
+  // Spatial pass over the boundary points the structured pass left alone: they are sorted by the
+  // grid cell of size tolerance they fall in, then every point looks up the runs of the 27 cells
+  // around it and is merged with the earliest point before it closer than tolerance.
+  float inv_cell = tolerance > 0.0f ? 1.0f / tolerance : 1.0e6f;
+  auto  cell_of  = [inv_cell](const float3& pos, int64_t* c){
+    for (int a = 0; a < 3; a++)
+      c[a] = static_cast<int64_t>(std::floor(pos.v[a] * inv_cell));
+  };
+  auto  cell_key = [](int64_t x, int64_t y, int64_t z){
+    return (static_cast<uint64_t>(x & 0x1FFFFF) << 42) | (static_cast<uint64_t>(y & 0x1FFFFF) << 21) | static_cast<uint64_t>(z & 0x1FFFFF);
+  };
+
+  const size_t        grain = 1 << 14;
+  std::vector<size_t> chunk_free((boundary.size() + grain - 1) / grain + 1, 0);
+  parallel_for(0, chunk_free.size() - 1, num_threads, [&](size_t chunk){
+    size_t count = 0;
+    for (size_t k = chunk * grain; k < std::min(boundary.size(), (chunk + 1) * grain); k++)
+      count += remap[boundary[k]] == boundary[k];
+    chunk_free[chunk + 1] = count;
+  });
+  for (size_t chunk = 0; chunk + 1 < chunk_free.size(); chunk++)
+    chunk_free[chunk + 1] += chunk_free[chunk];
+
+  std::vector<std::pair<uint64_t, uint32_t>> keys(chunk_free.back());
+  parallel_for(0, chunk_free.size() - 1, num_threads, [&](size_t chunk){
+    size_t next = chunk_free[chunk];
+    for (size_t k = chunk * grain; k < std::min(boundary.size(), (chunk + 1) * grain); k++){
+      uint32_t p = boundary[k];
+      if (remap[p] != p)
+        continue;
+      int64_t c[3];
+      cell_of(arrays.points[p], c);
+      keys[next++] = std::make_pair(cell_key(c[0], c[1], c[2]), p);
+    }
+  });
+
+  parallel_sort(keys.begin(), keys.end(), num_threads, [](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b){
+    return a < b;
+  });
+
+  float tolerance2 = tolerance * tolerance;
+
+  // the points of a run are sorted by index, so the scan of a run stops at p
+  parallel_for(0, keys.size(), num_threads, [&](size_t k){
+    uint32_t      p   = keys[k].second;
+    const float3& pos = arrays.points[p];
+    int64_t       c[3];
+    cell_of(pos, c);
+
+    uint32_t merged = p;
+    for (int64_t x = c[0] - 1; x <= c[0] + 1; x++)
+      for (int64_t y = c[1] - 1; y <= c[1] + 1; y++)
+        for (int64_t z = c[2] - 1; z <= c[2] + 1; z++){
+          auto run = std::lower_bound(keys.begin(), keys.end(), std::make_pair(cell_key(x, y, z), static_cast<uint32_t>(0)));
+          for (; run != keys.end() && run->first == cell_key(x, y, z) && run->second < merged; ++run){
+            const float3& other = arrays.points[run->second];
+            float dx = other.v[0] - pos.v[0];
+            float dy = other.v[1] - pos.v[1];
+            float dz = other.v[2] - pos.v[2];
+            if (dx * dx + dy * dy + dz * dz <= tolerance2){
+              merged = run->second;
+              break;
+            }
+          }
+        }
+    remap[p] = merged;
+  }, 1 << 10);
+
+  std::vector<std::pair<uint64_t, uint32_t>>().swap(keys);
+
+  // Every merged point refers to an earlier one, resolve the chains by pointer jumping until all
+  // of them lead to a kept point.
+  std::vector<uint32_t> jumped(boundary.size());
+  for (bool changed = true; changed;){
+    std::vector<uint8_t> chunk_changed(chunk_free.size() - 1, 0);
+    parallel_for(0, chunk_changed.size(), num_threads, [&](size_t chunk){
+      for (size_t k = chunk * grain; k < std::min(boundary.size(), (chunk + 1) * grain); k++){
+        uint32_t q = remap[boundary[k]];
+        jumped[k]  = remap[q];
+        chunk_changed[chunk] |= jumped[k] != q;
+      }
+    });
+    parallel_for(0, boundary.size(), num_threads, [&](size_t k){
+      remap[boundary[k]] = jumped[k];
+    }, 1 << 16);
+
+    changed = false;
+    for (uint8_t c : chunk_changed)
+      changed |= c != 0;
+  }
+
+  // compaction: new indices of the kept points, per block first
+  std::vector<size_t> block_kept(blocks.size() + 1, 0);
+  parallel_for(0, blocks.size(), num_threads, [&](size_t b){
+    size_t kept = 0;
+    for (size_t p = blocks[b].first_point; p < blocks[b].first_point + blocks[b].num_points(); p++)
+      kept += remap[p] == p;
+    block_kept[b + 1] = kept;
+  });
+  for (size_t b = 0; b < blocks.size(); b++)
+    block_kept[b + 1] += block_kept[b];
+
+  size_t num_kept = block_kept[blocks.size()];
+
+  std::vector<uint32_t> new_index(num_points);
+  std::vector<float3>   points(num_kept);
+  parallel_for(0, blocks.size(), num_threads, [&](size_t b){
+    size_t next = block_kept[b];
+    for (size_t p = blocks[b].first_point; p < blocks[b].first_point + blocks[b].num_points(); p++)
+      if (remap[p] == p){
+        points[next]  = arrays.points[p];
+        new_index[p]  = static_cast<uint32_t>(next++);
+      }
+  });
+  parallel_for(0, blocks.size(), num_threads, [&](size_t b){
+    for_each_block_boundary_point(blocks[b], [&](size_t local){
+      size_t p = blocks[b].first_point + local;
+      if (remap[p] != p)
+        new_index[p] = new_index[remap[p]];
+    });
+  });
+
+  std::vector<uint32_t>().swap(remap);
+
+  if (arrays.flags & STADIUM_FLAG_HEX8){
+    parallel_for(0, arrays.cellPoints.size(), num_threads, [&](size_t e){
+      arrays.cellPoints[e] = new_index[arrays.cellPoints[e]];
+    }, 1 << 16);
+  }
+  else {
+    parallel_for(0, arrays.cellPointsBegIndices.size(), num_threads, [&](size_t c){
+      uint32_t* cell = arrays.cellPoints.data() + arrays.cellPointsBegIndices[c];
+      for (uint32_t i = 1; i <= cell[0]; i++)
+        cell[i] = new_index[cell[i]];
+    }, 1 << 14);
+  }
+
+  arrays.points.swap(points);
+  arrays.pointVectors.assign(num_kept, float3(0.0f, 0.0f, 1.0f));
+
+  return num_points - num_kept;
+}
+
+#endif
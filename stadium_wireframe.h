@@ -0,0 +1,93 @@
+#ifndef __STADIUM_WIREFRAME_H__
+#define __STADIUM_WIREFRAME_H__
+
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+
+#include "stadium.h"
+
+// Unique edges of the block lattices as GL_LINES index pairs into the points of generate_stadium.
+// block_first[b] is the first index of block b, block_first[num_blocks] the total, so the edges of
+// a block or of a run of blocks are one contiguous range. layer_first[l] is the first index of
+// layer l, the total last, the same for the layers.
+struct StadiumWireframe {
+  std::vector<uint32_t> indices;
+  std::vector<size_t>   block_first;
+  std::vector<size_t>   layer_first;
+};
+
+// Number of unique edges of the block lattice, leaving out the faces shared through seams.
+inline size_t stadium_block_edge_count(const int* dims, uint8_t seams){
+  size_t i0 = (seams & STADIUM_SEAM_I) ? 1 : 0;
+  size_t j0 = (seams & STADIUM_SEAM_J) ? 1 : 0;
+  size_t n0 = dims[0], n1 = dims[1], n2 = dims[2];
+
+  return n0 * (n1 + 1 - j0) * (n2 + 1)          // along d0
+       + (n0 + 1 - i0) * n1 * (n2 + 1)          // along d1
+       + (n0 + 1 - i0) * (n1 + 1 - j0) * n2;    // along d2
+}
+
+// Writes the unique edges of the block lattice to indices[0 .. 2 * stadium_block_edge_count()),
+// global point indices. Every lattice point emits the up to three edges leaving it towards +d0,
+// +d1 and +d2, so each edge is written exactly once and neighbouring edges stay close in the index
+// buffer. The edges on the faces given by seams are left to the previous block.
+void generate_block_edges(const StadiumBlock& block, uint8_t seams, uint32_t* indices){
+  const int* dims  = block.dims;
+  int        i0    = (seams & STADIUM_SEAM_I) ? 1 : 0;
+  int        j0    = (seams & STADIUM_SEAM_J) ? 1 : 0;
+  uint32_t   step0 = static_cast<uint32_t>((dims[1] + 1) * (dims[2] + 1));
+  uint32_t   step1 = static_cast<uint32_t>(dims[2] + 1);
+
+  uint32_t p = static_cast<uint32_t>(block.first_point);
+  size_t   k = 0;
+  for (int d0 = 0; d0 <= dims[0]; d0++)
+    for (int d1 = 0; d1 <= dims[1]; d1++)
+      for (int d2 = 0; d2 <= dims[2]; d2++, p++){
+        if (d0 < dims[0] && d1 >= j0){
+          indices[k++] = p;
+          indices[k++] = p + step0;
+        }
+        if (d1 < dims[1] && d0 >= i0){
+          indices[k++] = p;
+          indices[k++] = p + step1;
+        }
+        if (d2 < dims[2] && d0 >= i0 && d1 >= j0){
+          indices[k++] = p;
+          indices[k++] = p + 1;
+        }
+      }
+}
+
+// Builds the wireframe of the blocks listed by compute_stadium_blocks. The edge counts give every
+// block its range up front, the blocks are then filled on num_threads workers. The indices are
+// 32 bits, the points of the stadium must fit them.
+void build_stadium_wireframe(const std::vector<StadiumBlock>& blocks, StadiumWireframe& wireframe, unsigned num_threads = 0){
+  StadiumBlockGrid     grid;
+  std::vector<uint8_t> seams;
+  compute_stadium_block_grid(blocks, grid);
+  compute_stadium_seams(blocks, grid, seams);
+
+  wireframe.block_first.resize(blocks.size() + 1);
+  wireframe.block_first[0] = 0;
+  for (size_t b = 0; b < blocks.size(); b++)
+    wireframe.block_first[b + 1] = wireframe.block_first[b] + 2 * stadium_block_edge_count(blocks[b].dims, seams[b]);
+
+  int num_layers = blocks.empty() ? 0 : blocks.back().layer + 1;
+  wireframe.layer_first.assign(num_layers + 1, wireframe.block_first.back());
+  for (size_t b = blocks.size(); b-- > 0;)
+    wireframe.layer_first[blocks[b].layer] = wireframe.block_first[b];
+
+  wireframe.indices.resize(wireframe.block_first.back());
+  parallel_for(0, blocks.size(), num_threads, [&](size_t b){
+    generate_block_edges(blocks[b], seams[b], wireframe.indices.data() + wireframe.block_first[b]);
+  });
+}
+
+void build_stadium_wireframe(const Stadium& stadium, StadiumWireframe& wireframe, unsigned num_threads = 0){
+  std::vector<StadiumBlock> blocks;
+  compute_stadium_blocks(stadium, blocks);
+  build_stadium_wireframe(blocks, wireframe, num_threads);
+}
+
+#endif